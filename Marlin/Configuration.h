@@ -377,12 +377,19 @@ New version (NEMA14 and NEMA17): 660 steps per mm (Huxley, Mendel Mono and Trico
 
 #define DEFAULT_ACCELERATION          1000    // X, Y, Z and E max acceleration in mm/s^2 for printing moves 
 #define DEFAULT_RETRACT_ACCELERATION  1000   // X, Y, Z and E max acceleration in mm/s^2 for r retracts
+#define DEFAULT_TRAVEL_ACCELERATION   1000    // X, Y, Z acceleration in mm/s^2 for moves without extrusion
 
 // 
 #define DEFAULT_XYJERK                15.0    // (mm/sec)
 #define DEFAULT_ZJERK                 0.4     // (mm/sec)
 #define DEFAULT_EJERK                 15.0    // (mm/sec)
 
+// Cornering: 0 = limit the jerk at each junction with the values above, 1 = junction deviation (M205 C)
+// Junction deviation limits the junction speed by the centripetal acceleration around a virtual arc whose
+// distance from the corner is DEFAULT_JUNCTION_DEVIATION, so shallow corners between short segments keep their speed.
+#define DEFAULT_CORNERING_MODE        0
+#define DEFAULT_JUNCTION_DEVIATION    0.05    // (mm)
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
@@ -42,6 +42,11 @@
 
 #define ENDSTOPS_ONLY_FOR_HOMING // If defined the endstops will only be used for homing
 
+// If defined the endstops trigger a pin change interrupt instead of being read on every step, which stops the
+// move at the step the switch closed. Only on ATmega644P/1284P boards (Sanguinololu, Melzi), others can't build it.
+// There is no debouncing, so noisy endstop wiring may stop moves early.
+//#define ENDSTOP_INTERRUPTS
+
 //#define Z_LATE_ENABLE // Enable Z the last moment. Needed if your Z driver overheats.
 
 //homing hits the endstop, then retracts by this distance, before it tries to slowly bump again:
@@ -53,6 +58,16 @@
 
 #define MAX_STEP_FREQUENCY 50000 // Max step frequency for Ultimaker (5000 pps / half step)
 
+// Budget for the stepper interrupt. Faster moves take 2 or 4 steps per interrupt, as few as keep the interrupt
+// rate below this. Slower moves run the bresenham tracer up to 2^MAX_STEP_OVERSAMPLING times per step within
+// the budget, which spreads the steps of the slower axes more evenly. Set MAX_STEP_OVERSAMPLING to 0 to save
+// the processor time at low speeds.
+#define MAX_STEP_ISR_FREQUENCY 10000
+#define MAX_STEP_OVERSAMPLING 2
+// Pulse the 2 or 4 steps of the faster moves' interrupts evenly spaced over the interval, from the short compare
+// B interrupt of timer 1, instead of one right after the other. Comment out to save those interrupts.
+#define SPREAD_MULTI_STEPS
+
 //default stepper release if idle
 #define DEFAULT_STEPPER_DEACTIVE_TIME 60
 
@@ -62,8 +77,10 @@
 // minimum time in microseconds that a movement needs to take if the buffer is emptied.   Increase this number if you see blobs while printing high speed & high detail.  It will slowdown on the detailed stuff.
 #define DEFAULT_MINSEGMENTTIME        20000   // Obsolete delete this
 
-// If defined the movements slow down when the look ahead buffer is only half full
+// If defined the movements slow down when the look ahead buffer holds less than SLOWDOWN_MIN_BUFFER_TIME
+// microseconds of motion. Segments shorter than the minimum segment time are then stretched towards it.
 #define SLOWDOWN
+#define SLOWDOWN_MIN_BUFFER_TIME 100000
 
 // Frequency limit
 // See nophead's blog for more info
@@ -75,6 +92,23 @@
 // if unwanted behavior is observed on a user's machine when running at very slow speeds.
 #define MINIMUM_PLANNER_SPEED 0.05 // (mm/sec)
 
+// Jerk limited S-curve acceleration instead of the constant acceleration trapezoid. Every acceleration and
+// deceleration ramp has three phases: the acceleration builds up, stays constant and fades out again, so the frame
+// never sees a sudden change of force. The ramps take as long as the trapezoid ramps they replace, so the peak
+// acceleration is 1/(1 - S_CURVE_JERK_PART) times the configured one. Can't be combined with ADVANCE.
+//#define S_CURVE_ACCELERATION
+#define S_CURVE_JERK_PART 0.25 // Part of each ramp spent building up and again fading out the acceleration, 0.05 to 0.5
+
+// Calculate the acceleration and deceleration steps of each block with integer math instead of soft floats.
+// The result is exact, where the float version may round a step either way. Comment out to use floats.
+#define FIXED_POINT_TRAPEZOID
+
+// Prepare the steps and timer intervals of the next stepper interrupts ahead of time, with interrupts enabled.
+// The stepper interrupt then only pulses the step pins, so the acceleration math no longer delays the steps and
+// higher step rates can be kept up. Can't be combined with ADVANCE.
+//#define STEP_EVENT_QUEUE
+#define STEP_EVENT_QUEUE_SIZE 16 // Step events prepared ahead, must be a power of 2
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
@@ -109,6 +143,20 @@
 
 const int dropsegments=5; //everything with less than this number of steps will be ignored as move and joined with the next movement
 
+// If defined, consecutive short G0/G1 moves that are nearly collinear are merged into one planner block.
+// This makes the look ahead buffer cover a longer distance when printing curves made of many tiny segments.
+// Any other command, or the planner running low while no commands are waiting, sends the pending move.
+// This changes the toolpath: corners up to SEGMENT_COALESCE_TOLERANCE are dropped, so it is off by default.
+//#define SEGMENT_COALESCING
+
+#ifdef SEGMENT_COALESCING
+  #define SEGMENT_COALESCE_MAX_LENGTH 1.0   // mm, longer moves are never merged and merged moves never get longer
+  #define SEGMENT_COALESCE_MAX_SEGMENTS 8   // Most segments merged into one move
+  #define SEGMENT_COALESCE_TOLERANCE 0.01   // mm, largest distance of a dropped corner from the merged move
+  #define SEGMENT_COALESCE_MAX_ANGLE 5      // degrees, largest change of direction between two merged segments
+  #define SEGMENT_COALESCE_E_RATIO 0.05     // Largest relative change of extrusion per mm between merged segments
+#endif
+
 // If you are using a RAMPS board or cheap E-bay purchased boards that do not detect when an SD card is inserted
 // You can get round this by connecting a push button or single throw switch to the pin defined as SDCARDCARDDETECT 
 // in the pins.h file.  When using a push button pulling the pin to ground this will need inverted.  This setting should
@@ -121,18 +169,58 @@ const int dropsegments=5; //everything with less than this number of steps will
 
 // The number of linear motions that can be in the plan at any give time.  
 // THE BLOCK_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts and ors are used to do the ringbuffering.
-#if defined SDSUPPORT
+#if defined(__AVR_ATmega1284P__)
+  // A block takes 67 bytes, 85 with S_CURVE_ACCELERATION and 16 more with ADVANCE, so 32 blocks take 2144 bytes
+  // where 16 blocks took 1232 before. With the SD card (about 1.8K, 1K of it the fast transfer buffer), the serial,
+  // command and resend buffers (708 bytes), the bed transform matrices (320 bytes) and the rest of the globals,
+  // about 5.5K of the 16K are static and about 10K are left for the stack. Counted from the sources, check with
+  // avr-size after enabling more options.
+  #define BLOCK_BUFFER_SIZE 32
+#elif defined SDSUPPORT
   #define BLOCK_BUFFER_SIZE 16   // SD,LCD,Buttons take more memory, block buffer needs to be smaller
-// Chuck size for fast sd transfer
-    #define SD_FAST_XFER_CHUNK_SIZE 1024
 #else
   #define BLOCK_BUFFER_SIZE 16 // maximize block buffer
 #endif
+#ifdef SDSUPPORT
+// Chuck size for fast sd transfer
+    #define SD_FAST_XFER_CHUNK_SIZE 1024
+#endif
 
 
 //The ASCII buffer for recieving from the serial:
 #define MAX_CMD_SIZE 96
-#define BUFSIZE 4
+// Bytes of the queue of received commands. A move with X, Y and E takes 18 bytes and one with X and Y 14 bytes,
+// so 16 to 20 moves fit. Commands that keep their text, like file names and messages, take up to MAX_CMD_SIZE + 8
+// bytes. Together with the MAX_CMD_SIZE bytes of the line being received this is the RAM of the old text buffer,
+// 4 lines of MAX_CMD_SIZE and their 4 SD flags.
+#define CMD_QUEUE_SIZE (4*MAX_CMD_SIZE + 4 - MAX_CMD_SIZE)
+// Acknowledge commands with "ok N<line> P<free planner blocks> B<free command queue slots>" instead of a bare
+// "ok". N is the last line number received, B counts moves with up to 4 parameters. Hosts that understand it can
+// keep sending lines while these counts stay above zero instead of waiting for every ok.
+//#define ADVANCED_OK
+
+// After a line with a bad checksum or a missing line, hold the correct lines that arrive after it and ask for the
+// missing lines alone with "Resend: <line>", instead of flushing the receive buffer and asking for everything from
+// there on. Held lines are acknowledged once they are queued. Hosts that wait for every ok work as before, hosts
+// that keep several lines in flight have to resend just the requested lines, even with their window full. Lines
+// that arrive twice are acknowledged and skipped. M529 reports how often this happened.
+//#define SELECTIVE_RESEND
+#define RESEND_HOLD_SIZE 128 // Bytes for the held lines, at most 255
+
+// Let M530 S1 switch the serial port to frames with a sequence number and a CRC16. G0 and G1 are sent as changes
+// of fixed point values, about 15 bytes for a typical move instead of 30 to 40, and decoded straight into the
+// command queue. Other commands are sent as text in a frame. Text lines stay the default until M530 S1.
+// binary_gcode.py is a host side implementation. The frame format is described in Marlin.ino.
+//#define BINARY_PROTOCOL
+
+// Let M155 S<seconds> make the firmware send the temperatures on its own, as "T:<hotend> /<target> B:<bed>
+// /<target> @:<power>" lines without ok, so the host doesn't have to ask with M105. M155 S0 stops them again.
+//#define AUTO_REPORT_TEMPERATURES
+
+// Bytes the serial receive interrupt can buffer until the main loop reads them. A power of 2, at most 256.
+#define RX_BUFFER_SIZE 128
+// Bytes the main loop can queue for sending without waiting for the serial line. A power of 2, at most 256.
+#define TX_BUFFER_SIZE 64
 
 //===========================================================================
 //=============================  Define Defines  ============================
@@ -39,7 +39,7 @@ template <class T> int EEPROM_readAnything(int &ee, T& value)
 // the default values are used whenever there is a change to the data, to prevent
 // wrong data being written to the variables.
 // ALSO:  always make sure the variables in the Store and retrieve sections are in the same order.
-#define EEPROM_VERSION "V05"  
+#define EEPROM_VERSION "V07"  
 
 inline void EEPROM_StoreSettings() 
 {
@@ -52,12 +52,15 @@ inline void EEPROM_StoreSettings()
   EEPROM_writeAnything(i,max_acceleration_units_per_sq_second);
   EEPROM_writeAnything(i,acceleration);
   EEPROM_writeAnything(i,retract_acceleration);
+  EEPROM_writeAnything(i,travel_acceleration);
   EEPROM_writeAnything(i,minimumfeedrate);
   EEPROM_writeAnything(i,mintravelfeedrate);
   EEPROM_writeAnything(i,minsegmenttime);
   EEPROM_writeAnything(i,max_xy_jerk);
   EEPROM_writeAnything(i,max_z_jerk);
   EEPROM_writeAnything(i,max_e_jerk);
+  EEPROM_writeAnything(i,cornering_mode);
+  EEPROM_writeAnything(i,junction_deviation);
   EEPROM_writeAnything(i,add_homeing);
   #ifdef PIDTEMP
     EEPROM_writeAnything(i,Kp);
@@ -122,13 +125,14 @@ inline void EEPROM_printSettings()
       SERIAL_ECHOPAIR(" E" ,max_acceleration_units_per_sq_second[3]);
       SERIAL_ECHOLN("");
     SERIAL_ECHO_START;
-      SERIAL_ECHOLNPGM("Acceleration: S=acceleration, T=retract acceleration");
+      SERIAL_ECHOLNPGM("Acceleration: P=print acceleration, R=retract acceleration, T=travel acceleration");
       SERIAL_ECHO_START;
-      SERIAL_ECHOPAIR("  M204 S",acceleration ); 
-      SERIAL_ECHOPAIR(" T" ,retract_acceleration);
+      SERIAL_ECHOPAIR("  M204 P",acceleration ); 
+      SERIAL_ECHOPAIR(" R" ,retract_acceleration);
+      SERIAL_ECHOPAIR(" T" ,travel_acceleration);
       SERIAL_ECHOLN("");
     SERIAL_ECHO_START;
-      SERIAL_ECHOLNPGM("Advanced variables: S=Min feedrate (mm/s), T=Min travel feedrate (mm/s), B=minimum segment time (ms), X=maximum xY jerk (mm/s),  Z=maximum Z jerk (mm/s), K=advance_k");
+      SERIAL_ECHOLNPGM("Advanced variables: S=Min feedrate (mm/s), T=Min travel feedrate (mm/s), B=minimum segment time (ms), X=maximum xY jerk (mm/s),  Z=maximum Z jerk (mm/s), E=maximum E jerk (mm/s), C=cornering mode (0=jerk, 1=junction deviation), J=junction deviation (mm), K=advance_k");
       SERIAL_ECHO_START;
       SERIAL_ECHOPAIR("  M205 S",minimumfeedrate ); 
       SERIAL_ECHOPAIR(" T" ,mintravelfeedrate ); 
@@ -136,6 +140,8 @@ inline void EEPROM_printSettings()
       SERIAL_ECHOPAIR(" X" ,max_xy_jerk ); 
       SERIAL_ECHOPAIR(" Z" ,max_z_jerk);
       SERIAL_ECHOPAIR(" E" ,max_e_jerk);
+      SERIAL_ECHOPAIR(" C" ,(int)cornering_mode);
+      SERIAL_ECHOPAIR(" J" ,junction_deviation);
       #ifdef ADVANCE
       SERIAL_ECHOPAIR(" K" ,advance_k);
       #endif
@@ -195,12 +201,15 @@ inline void EEPROM_RetrieveSettings(bool def=false)
       EEPROM_readAnything(i,max_acceleration_units_per_sq_second);
       EEPROM_readAnything(i,acceleration);
       EEPROM_readAnything(i,retract_acceleration);
+      EEPROM_readAnything(i,travel_acceleration);
       EEPROM_readAnything(i,minimumfeedrate);
       EEPROM_readAnything(i,mintravelfeedrate);
       EEPROM_readAnything(i,minsegmenttime);
       EEPROM_readAnything(i,max_xy_jerk);
       EEPROM_readAnything(i,max_z_jerk);
       EEPROM_readAnything(i,max_e_jerk);
+      EEPROM_readAnything(i,cornering_mode);
+      EEPROM_readAnything(i,junction_deviation);
       EEPROM_readAnything(i,add_homeing);
       #ifndef PIDTEMP
         float Kp,Ki,Kd;
@@ -245,12 +254,15 @@ inline void EEPROM_RetrieveSettings(bool def=false)
       }
       acceleration=DEFAULT_ACCELERATION;
       retract_acceleration=DEFAULT_RETRACT_ACCELERATION;
+      travel_acceleration=DEFAULT_TRAVEL_ACCELERATION;
       minimumfeedrate=DEFAULT_MINIMUMFEEDRATE;
       minsegmenttime=DEFAULT_MINSEGMENTTIME;       
       mintravelfeedrate=DEFAULT_MINTRAVELFEEDRATE;
       max_xy_jerk=DEFAULT_XYJERK;
       max_z_jerk=DEFAULT_ZJERK;
       max_e_jerk=DEFAULT_EJERK;
+      cornering_mode=DEFAULT_CORNERING_MODE;
+      junction_deviation=DEFAULT_JUNCTION_DEVIATION;
       #ifdef ADVANCE
       advance_k=EXTRUDER_ADVANCE_K;
       #endif
@@ -175,7 +175,7 @@ void FlushSerialRequestResend();
 void ClearToSend();
 
 void get_coordinates();
-void prepare_move();
+void prepare_move(bool coalesce=false); // coalesce: G0/G1 move that may be merged with the next ones
 void kill();
 void Stop();
 
@@ -50,6 +50,10 @@
 #include "language.h"
 #include "pins_arduino.h"
 #include "slave_comms.h"
+#include "parse_number.h"
+#ifdef BINARY_PROTOCOL
+#include <util/crc16.h>
+#endif
 
 #define VERSION_STRING  "1.0.2 RRP"
 
@@ -110,13 +114,15 @@
 // M117 - display message
 // M119 - Output Endstop status to serial port
 // M140 - Set bed target temp
+// M155 - S<seconds> between temperature reports sent without asking, S0 for none (AUTO_REPORT_TEMPERATURES)
 // M190 - Wait for bed current temp to reach target temp.
 // M200 - Set filament diameter
 // M201 - Set max acceleration in units/s^2 for print moves (M201 X1000 Y1000)
 // M202 - Set max acceleration in units/s^2 for travel moves (M202 X1000 Y1000) Unused in Marlin!!
 // M203 - Set maximum feedrate that your machine can sustain (M203 X200 Y200 Z300 E10000) in mm/sec
-// M204 - Set default acceleration: S normal moves T filament only moves (M204 S3000 T7000) im mm/sec^2  also sets minimum segment time in ms (B20000) to prevent buffer underruns and M20 minimum feedrate
-// M205 -  advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk
+// M204 - Set default acceleration: P printing moves R filament only moves T travel moves S printing and travel moves (M204 P3000 R7000 T4000) im mm/sec^2
+// M205 -  advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk,
+//          C=cornering mode (0=jerk, 1=junction deviation), J=junction deviation in mm
 // M206 - set additional homeing offset
 // M208 - set axis max length
 // M220 S<factor in percent>- set speed factor override percentage
@@ -131,6 +137,8 @@
 // M501 - reads parameters from EEPROM (if you need reset them after you changed them temporarily).  
 // M502 - reverts to the default "factory settings".  You still need to store them in EEPROM afterwards if you want to.
 // M503 - print the current settings (from memory not from eeprom)
+// M529 - Report the checksum errors, line number errors and resend requests of the serial line. M529 R also resets the counters
+// M530 - S1 switches the serial port to the binary protocol after the ok, S0 back to text lines (BINARY_PROTOCOL)
 // M510 - FPU Enable
 // M511 - FPU Reset
 // M512 - FPU Disable
@@ -159,6 +167,7 @@ bool axis_relative_modes[] = AXIS_RELATIVE_MODES;
 volatile int feedmultiply=100; //100->1 200->2
 int saved_feedmultiply;
 volatile bool feedmultiplychanged=false;
+static int planned_feedmultiply=100; // The feedmultiply the moves in the planner were planned with
 volatile int extrudemultiply=100; //100->1 200->2
 float current_position[NUM_AXIS] = { 0.0, 0.0, 0.0, 0.0 };
 float add_homeing[3]={0,0,0};
@@ -195,20 +204,81 @@ const char axis_codes[NUM_AXIS] = {'X', 'Y', 'Z', 'E'};
 static bool home_all_axis = true;
 static long gcode_N, gcode_LastN, Stopped_gcode_LastN = 0;
 
+// Serial line error counters, reported by M529
+static unsigned int checksum_errors = 0;
+static unsigned int line_number_errors = 0;
+static unsigned int resend_requests = 0;
+#ifdef SELECTIVE_RESEND
+static unsigned int lines_held = 0;
+static unsigned int lines_skipped = 0;
+// The correct lines received before the lines in front of them, each a long line number followed by the text
+static char held_lines[RESEND_HOLD_SIZE];
+static unsigned char held_length = 0;   // Bytes used in held_lines
+static long highest_N = 0;              // Highest line number received or asked for
+#define MAX_HELD_LINES ((long)(RESEND_HOLD_SIZE / (sizeof(long) + 2))) // Lines held_lines can take, at least 1 character each
+#endif
+#ifdef AUTO_REPORT_TEMPERATURES
+static unsigned char temperature_report_interval = 0; // Seconds between the reports of M155, 0 for none
+static unsigned long next_temperature_report;        // When the next report is due
+#endif
+#ifdef BINARY_PROTOCOL
+static bool binary_mode = false;        // Set by M530 S1, the serial port then sends frames instead of lines
+static unsigned char binary_seq;        // Sequence number of the next frame
+static bool binary_resend_sent;         // Frames are dropped until binary_seq arrives again
+static long binary_values[5];           // Last X, Y, Z, E and F of the moves, in fixed point
+#endif
+
 static bool relative_mode = false;  //Determines Absolute or Relative Coordinates
 static bool relative_mode_e = false;  //Determines Absolute or Relative E Codes while in Absolute Coordinates mode. E is always relative in Relative Coordinates mode.
 
-static char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
-static bool fromsd[BUFSIZE];
-static int bufindr = 0;
-static int bufindw = 0;
-static int buflen = 0;
+static char cmdline[MAX_CMD_SIZE]; // The line being received from the serial port or read from the SD card
+static bool line_pending = false; // cmdline holds a complete line that waits for room in cmd_queue
+static unsigned char line_flags;  // The CMD_* flags of the pending line
 //static int i = 0;
 static char serial_char;
 static int serial_count = 0;
 static boolean comment_mode = false;
 static char *strchr_pointer; // just a pointer to find chars in the cmd string like X, Y, Z, E, etc
 
+// The received commands wait in cmd_queue until process_commands() executes them. Each takes a 6 byte
+// cmd_header_t followed by the values of its parameters in alphabetic order, so a move only needs about 16 bytes.
+// Commands that need their text (file names, messages) keep it instead of the values. The size of a record
+// follows from the number of letters or the length of the text. Records never wrap around the end of cmd_queue,
+// CMD_END or less room than a header marks the part at the end that was left unused.
+#define CMD_FROM_SD  1        // Read from the SD card, no ok is sent for it
+#define CMD_HAS_TEXT 2        // The text of the command follows the header instead of the values
+#define CMD_FLAGS_SHIFT 30    // The CMD_* bits are kept above the letters
+#define CMD_LETTERS ((1UL << ('Z' - 'A' + 1)) - 1)
+#define CMD_CODE_SHIFT 14     // 1, 2 or 3 for G, M and T above the number, 0 if the command has none of them
+#define CMD_NUMBER ((1 << CMD_CODE_SHIFT) - 1)
+#define CMD_END CMD_NUMBER    // No code but a number, which no command has
+typedef struct {
+  unsigned short command;     // The code and the number after it, numbers above CMD_NUMBER are cut off
+  unsigned long letters;      // Bit (letter - 'A') is set for each parameter that has a value in the record
+} cmd_header_t;
+static char cmd_queue[CMD_QUEUE_SIZE];
+static unsigned short cmd_queue_head = 0; // Index of the next record to be written
+static unsigned short cmd_queue_tail = 0; // Index of the next record to be executed
+static int buflen = 0;                    // Number of commands in cmd_queue
+static bool keep_text = false;            // Set from M28 to M29, these lines are written to the SD card as text
+static cmd_header_t *current_cmd = NULL;  // The command process_commands() executes
+static float seen_value;                  // The value code_seen() found
+static bool seen_in_text;                 // code_seen() searched the text, code_value() has to parse it
+
+// M109, M190 and tool changes don't wait for the temperature inside process_commands(). They set temp_wait and
+// stay at the tail of cmd_queue while loop() keeps receiving and queueing the commands behind them and polls the
+// temperature with check_temp_wait() instead of executing them.
+#define WAIT_NONE   0
+#define WAIT_HOTEND 1
+#define WAIT_BED    2
+static unsigned char temp_wait = WAIT_NONE;
+static uint8_t wait_extruder;             // The hotend of WAIT_HOTEND
+static bool wait_heating;                 // WAIT_HOTEND waits for the hotend to heat up, not to cool down
+static unsigned long wait_report;         // When the temperature was last reported
+#ifdef TEMP_RESIDENCY_TIME
+static long residency_start;              // When the hotend reached its target, -1 if it hasn't yet
+#endif
+
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
 //static float tt = 0;
@@ -250,21 +320,446 @@ extern "C"{
   }
 }
 
+// Returns where a record of size bytes can be written to cmd_queue, NULL if there is no room for it
+static char *reserve_command(unsigned char size)
+{
+  if(buflen == 0) {
+    cmd_queue_head = cmd_queue_tail = 0;
+  }
+  else if(cmd_queue_head == cmd_queue_tail) {
+    return NULL; // Full
+  }
+  if(cmd_queue_head >= cmd_queue_tail) {
+    if(CMD_QUEUE_SIZE - cmd_queue_head >= size) return &cmd_queue[cmd_queue_head];
+    if(cmd_queue_tail < size) return NULL;
+    if(CMD_QUEUE_SIZE - cmd_queue_head >= sizeof(cmd_header_t)) { // Continue at the start
+      ((cmd_header_t *)&cmd_queue[cmd_queue_head])->command = CMD_END;
+    }
+    cmd_queue_head = 0;
+    return cmd_queue;
+  }
+  if(cmd_queue_tail - cmd_queue_head >= size) return &cmd_queue[cmd_queue_head];
+  return NULL;
+}
+
+FORCE_INLINE char *command_text(cmd_header_t *cmd)
+{
+  return (char *)(cmd + 1);
+}
+
+FORCE_INLINE unsigned char command_flags(cmd_header_t *cmd)
+{
+  return cmd->letters >> CMD_FLAGS_SHIFT;
+}
+
+FORCE_INLINE char command_code(cmd_header_t *cmd)
+{
+  return "\0GMT"[cmd->command >> CMD_CODE_SHIFT];
+}
+
+FORCE_INLINE unsigned short command_number(cmd_header_t *cmd)
+{
+  return cmd->command & CMD_NUMBER;
+}
+
+// Bytes of the whole record. The text of a command can be changed while it is executed, so this has to be
+// taken before.
+static unsigned char command_size(cmd_header_t *cmd)
+{
+  if(command_flags(cmd) & CMD_HAS_TEXT) return sizeof(cmd_header_t) + strlen(command_text(cmd)) + 3;
+  unsigned char count = 0;
+  for(unsigned long letters = cmd->letters & CMD_LETTERS; letters != 0; letters &= letters - 1) count++;
+  return sizeof(cmd_header_t) + count * sizeof(float);
+}
+
+// Parses line and appends it to cmd_queue. The first G, M or T followed by a digit is the code of the command,
+// the first occurrence of every other capital letter but N is a parameter. Returns NULL if there is no room.
+static cmd_header_t *queue_command(const char *line, unsigned char flags)
+{
+  unsigned char offsets['Z' - 'A' + 1];
+  unsigned long letters = 0;
+  unsigned char count = 0;
+  char code = 0;
+  unsigned short command = 0;
+  unsigned char code_offset = 0;
+  for(unsigned char i = 0; line[i] != 0; i++) {
+    char c = line[i];
+    if(c < 'A' || c > 'Z' || c == 'N') continue;
+    if(code == 0 && (c == 'G' || c == 'M' || c == 'T') && line[i + 1] >= '0' && line[i + 1] <= '9') {
+      code = c;
+      command = (c == 'G' ? 1 : c == 'M' ? 2 : 3) << CMD_CODE_SHIFT;
+      code_offset = i;
+      continue;
+    }
+    unsigned long bit = 1UL << (c - 'A');
+    if(letters & bit) continue;
+    letters |= bit;
+    offsets[c - 'A'] = i;
+    count++;
+  }
+  unsigned short number = code ? parse_long(&line[code_offset + 1]) & CMD_NUMBER : 0;
+
+  // Unknown commands keep the text to echo it
+  if(code == 0 || keep_text ||
+     (code == 'M' && (number == 23 || number == 26 || number == 28 || number == 30 || number == 32 || number == 117))) {
+    flags |= CMD_HAS_TEXT;
+  }
+  // CardReader::write_command() appends \r\n in place, so text gets 2 spare bytes
+  unsigned char size = sizeof(cmd_header_t) + ((flags & CMD_HAS_TEXT) ? strlen(line) + 3 : count * sizeof(float));
+  char *record = reserve_command(size);
+  if(record == NULL) return NULL;
+
+  cmd_header_t *cmd = (cmd_header_t *)record;
+  cmd->command = command | number;
+  if(flags & CMD_HAS_TEXT) {
+    cmd->letters = (unsigned long)flags << CMD_FLAGS_SHIFT;
+    strcpy(command_text(cmd), line);
+  }
+  else {
+    cmd->letters = letters | ((unsigned long)flags << CMD_FLAGS_SHIFT);
+    float *value = (float *)(cmd + 1);
+    for(unsigned char l = 0; letters != 0; l++, letters >>= 1) {
+      if(letters & 1) *value++ = parse_float(&line[offsets[l] + 1]);
+    }
+  }
+  if(code == 'M' && number == 28) keep_text = true;
+  if(code == 'M' && number == 29) keep_text = false;
+  cmd_queue_head = (record - cmd_queue) + size;
+  buflen++;
+  return cmd;
+}
+
+#ifdef ADVANCED_OK
+// Returns how many more moves with 4 parameters cmd_queue has room for
+static unsigned char free_command_slots()
+{
+  const unsigned char move_size = sizeof(cmd_header_t) + 4 * sizeof(float);
+  unsigned char slots;
+  if(buflen == 0)
+    slots = CMD_QUEUE_SIZE / move_size;
+  else if(cmd_queue_head == cmd_queue_tail)
+    slots = 0;
+  else if(cmd_queue_head > cmd_queue_tail)
+    slots = (CMD_QUEUE_SIZE - cmd_queue_head) / move_size + cmd_queue_tail / move_size;
+  else
+    slots = (cmd_queue_tail - cmd_queue_head) / move_size;
+  if(line_pending && slots > 0) slots--;
+  return slots;
+}
+#endif
+
+// Acknowledges a command. The advanced ok also tells the host the last line number received and the room left
+// in the planner and in cmd_queue, so it can keep several lines in flight.
+static void send_ok()
+{
+  #ifdef ADVANCED_OK
+    SERIAL_PROTOCOLPGM(MSG_OK);
+    SERIAL_PROTOCOLPGM(" N");
+    SERIAL_PROTOCOL(gcode_LastN);
+    SERIAL_PROTOCOLPGM(" P");
+    SERIAL_PROTOCOL((int)(BLOCK_BUFFER_SIZE - 1 - movesplanned()));
+    SERIAL_PROTOCOLPGM(" B");
+    SERIAL_PROTOCOLLN((int)free_command_slots());
+  #else
+    SERIAL_PROTOCOLLNPGM(MSG_OK);
+  #endif
+}
+
+// Moves from the serial port are acknowledged as soon as they are queued
+static void acknowledge_move(cmd_header_t *cmd)
+{
+  if(!(command_flags(cmd) & CMD_FROM_SD) && command_code(cmd) == 'G' && command_number(cmd) <= 3) {
+    if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
+      #ifdef SDSUPPORT
+      if(card.saving)
+        return;
+      #endif //SDSUPPORT
+      send_ok();
+    }
+    else {
+      SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+      LCD_MESSAGEPGM(MSG_STOPPED);
+    }
+  }
+}
+
+// Queues the complete and checked line in cmdline. If cmd_queue has no room for it, it stays pending and no
+// more characters are read until it fits.
+static void queue_line()
+{
+  cmd_header_t *cmd = queue_command(cmdline, line_flags);
+  line_pending = (cmd == NULL);
+  if(line_pending) return;
+  serial_count = 0;
+  acknowledge_move(cmd);
+}
+
+#ifdef SELECTIVE_RESEND
+// Returns the held line numbered n, NULL if there is none
+static char *find_held_line(long n)
+{
+  for(char *held = held_lines; held < &held_lines[held_length]; held += sizeof(long) + strlen(held + sizeof(long)) + 1) {
+    if(*(long *)held == n) return held;
+  }
+  return NULL;
+}
+
+// Asks the host for line n alone
+static void request_line(long n)
+{
+  resend_requests++;
+  SERIAL_PROTOCOLPGM(MSG_RESEND);
+  SERIAL_PROTOCOLLN(n);
+}
+
+// Decides what to do with a correct line numbered gcode_N. Returns true if it is the next line and is queued
+// now. Lines that come early are held and the lines missing in front of them asked for, lines that are already
+// queued or held are acknowledged and skipped.
+static bool sort_line(bool set_line_number)
+{
+  if(set_line_number) {
+    held_length = 0;
+    highest_N = gcode_N;
+    return true;
+  }
+  if(gcode_N <= gcode_LastN || find_held_line(gcode_N) != NULL) {
+    lines_skipped++;
+    ClearToSend();
+    return false;
+  }
+  if(gcode_N - gcode_LastN - 1 > MAX_HELD_LINES) {
+    // More lines are missing than the lines behind them could be held for, and asking for each of them would
+    // block on the serial line. Ask for everything from the first missing line on instead.
+    line_number_errors++;
+    held_length = 0;
+    highest_N = gcode_LastN;
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
+    SERIAL_ERRORLN(gcode_LastN);
+    FlushSerialRequestResend();
+    return false;
+  }
+  if(gcode_N > highest_N) {
+    for(long n = highest_N + 1; n < gcode_N; n++) {
+      line_number_errors++;
+      request_line(n);
+    }
+    highest_N = gcode_N;
+  }
+  if(gcode_N == gcode_LastN + 1) return true;
+
+  unsigned char length = sizeof(long) + strlen(cmdline) + 1;
+  if(length <= RESEND_HOLD_SIZE - held_length) {
+    // Acknowledged when it is queued
+    *(long *)&held_lines[held_length] = gcode_N;
+    strcpy(&held_lines[held_length + sizeof(long)], cmdline);
+    held_length += length;
+    lines_held++;
+  }
+  else {
+    request_line(gcode_N);
+    ClearToSend();
+  }
+  return false;
+}
+
+// Asks again for all missing lines after a broken line, which may have been any of them or the next new one
+static void request_broken_line()
+{
+  if(highest_N <= gcode_LastN) highest_N = gcode_LastN + 1;
+  for(long n = gcode_LastN + 1; n <= highest_N; n++) {
+    if(find_held_line(n) == NULL) request_line(n);
+  }
+  ClearToSend();
+}
+
+// Queues the held lines that follow the last queued line. Returns false if one of them has to wait for room.
+static bool release_held_lines()
+{
+  char *held;
+  while((held = find_held_line(gcode_LastN + 1)) != NULL) {
+    cmd_header_t *cmd = queue_command(held + sizeof(long), 0);
+    if(cmd == NULL) return false;
+    gcode_LastN++; // Before the ok, which tells an advanced ok host the number of this line
+    acknowledge_move(cmd);
+    unsigned char length = sizeof(long) + strlen(held + sizeof(long)) + 1;
+    held_length -= length;
+    memmove(held, held + length, &held_lines[held_length] - held);
+  }
+  return true;
+}
+#endif
+
+#ifdef BINARY_PROTOCOL
+// After M530 S1 the host sends frames instead of lines:
+//   0xa5, payload length, sequence number, type, payload, CRC16 low byte, CRC16 high byte
+// The CRC16 is the XMODEM one started at 0xffff, over the bytes from the length to the end of the payload. The
+// payload of a BINARY_TEXT frame is a command without line number or checksum. A BINARY_MOVE payload is a G1
+// (G0 if bit 7 of the first byte is set) and starts with a byte that has bit 0 to 4 set for each of X, Y, Z, E
+// and F it sets, then 2 bytes with 2 bits for each of them from bit 0 on: 0 if the value is given as a change
+// of the last one that fits 8 bits, 1 if the change takes 16 bits, 2 for the new value in 32 bits. The values
+// follow in that order, low byte first, in 1/1000 mm and mm/min and 1/100000 mm for E. Frames are acknowledged
+// with ok like lines. A broken frame or a gap in the sequence numbers is answered with "Resend: <sequence
+// number>" and all frames are dropped until that one arrives, repeated frames that are already queued are
+// dropped silently. Every Resend makes the host send all frames from there on again, so the broken frames that
+// follow are not asked for again unless they are the frame asked for. The host sends the frames again after a
+// timeout if a Resend was lost. The SD card can't be written to in binary mode.
+#define BINARY_SYNC 0xa5
+#define BINARY_TEXT 1
+#define BINARY_MOVE 2
+#define BINARY_G0 0x80
+
+// Returns the bytes a move payload with these mask and size bytes takes, 0 if a size is invalid
+static unsigned char binary_move_length(const unsigned char *payload)
+{
+  unsigned char length = 3;
+  unsigned short sizes = payload[1] | ((unsigned short)payload[2] << 8);
+  for(unsigned char i = 0; i < 5; i++, sizes >>= 2) {
+    if(!(payload[0] & (1 << i))) continue;
+    if((sizes & 3) == 3) return 0;
+    length += 1 << (sizes & 3);
+  }
+  return length;
+}
+
+// Asks the host to send the frames again from binary_seq on
+static void request_frame()
+{
+  resend_requests++;
+  binary_resend_sent = true;
+  SERIAL_PROTOCOLPGM(MSG_RESEND);
+  SERIAL_PROTOCOLLN((int)binary_seq);
+}
+
+// Returns true if the frame in cmdline is intact and the next one, the text of a BINARY_TEXT frame is then
+// terminated in place of the CRC16
+static bool check_frame()
+{
+  unsigned char length = cmdline[1];
+  unsigned short crc = 0xffff;
+  for(unsigned char i = 1; i < length + 4; i++) crc = _crc_xmodem_update(crc, cmdline[i]);
+  if((unsigned char)cmdline[length + 4] != (crc & 0xff) || (unsigned char)cmdline[length + 5] != (crc >> 8)) {
+    checksum_errors++;
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
+    SERIAL_ERRORLN((int)(unsigned char)(binary_seq - 1));
+    // Once asked, only ask again if the sequence number says the broken frame was the one sent again
+    if(!binary_resend_sent || (unsigned char)cmdline[2] == binary_seq) request_frame();
+    return false;
+  }
+  unsigned char seq = cmdline[2];
+  if(seq != binary_seq) {
+    // Up to 128 behind is a repeated frame, anything else means frames were lost
+    if((unsigned char)(binary_seq - seq) > 128 && !binary_resend_sent) {
+      line_number_errors++;
+      request_frame();
+    }
+    return false;
+  }
+  binary_resend_sent = false;
+  binary_seq++;
+  const unsigned char *payload = (const unsigned char *)&cmdline[4];
+  if(cmdline[3] == BINARY_MOVE && length >= 3 && binary_move_length(payload) == length) return true;
+  if(cmdline[3] == BINARY_TEXT) {
+    cmdline[length + 4] = 0;
+    return true;
+  }
+  SERIAL_ERROR_START;
+  SERIAL_ERRORLNPGM(MSG_ERR_UNKNOWN_FRAME);
+  ClearToSend();
+  return false;
+}
+
+// Decodes the move payload straight into cmd_queue. The last values only change once it is queued, so it can be
+// decoded again while it waits for room. Returns NULL if there is no room.
+static cmd_header_t *queue_binary_move(const unsigned char *payload)
+{
+  long values[5];
+  unsigned long letters = 0;
+  unsigned char count = 0;
+  unsigned short sizes = payload[1] | ((unsigned short)payload[2] << 8);
+  const unsigned char *field = payload + 3;
+  for(unsigned char i = 0; i < 5; i++, sizes >>= 2) {
+    values[i] = binary_values[i];
+    if(!(payload[0] & (1 << i))) continue;
+    switch(sizes & 3) {
+      case 0:
+        values[i] += (signed char)field[0];
+        field += 1;
+        break;
+      case 1:
+        values[i] += (short)(field[0] | ((unsigned short)field[1] << 8));
+        field += 2;
+        break;
+      default:
+        values[i] = field[0] | ((unsigned long)field[1] << 8) | ((unsigned long)field[2] << 16) | ((unsigned long)field[3] << 24);
+        field += 4;
+        break;
+    }
+    letters |= 1UL << ("XYZEF"[i] - 'A');
+    count++;
+  }
+  unsigned char size = sizeof(cmd_header_t) + count * sizeof(float);
+  char *record = reserve_command(size);
+  if(record == NULL) return NULL;
+
+  cmd_header_t *cmd = (cmd_header_t *)record;
+  cmd->command = (1 << CMD_CODE_SHIFT) | ((payload[0] & BINARY_G0) ? 0 : 1);
+  cmd->letters = letters;
+  // The values in alphabetic order, E, F, X, Y, Z
+  float *value = (float *)(cmd + 1);
+  for(unsigned char n = 0, i = E_AXIS; n < 5; n++, i = (i == 4) ? 0 : i + 1) {
+    if(payload[0] & (1 << i)) *value++ = values[i] / ((i == E_AXIS) ? 100000.0 : 1000.0);
+  }
+  memcpy(binary_values, values, sizeof(binary_values));
+  cmd_queue_head = (record - cmd_queue) + size;
+  buflen++;
+  return cmd;
+}
+
+// Queues the checked frame in cmdline, like queue_line() it stays pending while cmd_queue has no room for it
+static void queue_frame()
+{
+  cmd_header_t *cmd;
+  if(cmdline[3] == BINARY_MOVE)
+    cmd = queue_binary_move((const unsigned char *)&cmdline[4]);
+  else
+    cmd = queue_command(&cmdline[4], 0);
+  line_pending = (cmd == NULL);
+  if(line_pending) {
+    line_flags = 0;
+    return;
+  }
+  acknowledge_move(cmd);
+}
+
+// Collects the frames from the serial port in cmdline
+static void get_binary_frames()
+{
+  while(MYSERIAL.available() > 0 && !line_pending) {
+    unsigned char c = MYSERIAL.read();
+    if(serial_count == 0 && c != BINARY_SYNC) continue;
+    if(serial_count == 1 && c > MAX_CMD_SIZE - 6) { // Too long, not the start of a frame
+      serial_count = 0;
+      continue;
+    }
+    cmdline[serial_count++] = c;
+    if(serial_count < 2 || serial_count < (unsigned char)cmdline[1] + 6) continue;
+    serial_count = 0;
+    if(check_frame()) queue_frame();
+  }
+}
+#endif
+
 //adds an command to the main command buffer
-//thats really done in a non-safe way.
-//needs overworking someday
 void enquecommand(const char *cmd)
 {
-  if(buflen < BUFSIZE)
+  if(queue_command(cmd, 0))
   {
-    //this is dangerous if a mixing of serial and this happsens
-    strcpy(&(cmdbuffer[bufindw][0]),cmd);
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM("enqueing \"");
-    SERIAL_ECHO(cmdbuffer[bufindw]);
+    SERIAL_ECHO(cmd);
     SERIAL_ECHOLNPGM("\"");
-    bufindw= (bufindw + 1)%BUFSIZE;
-    buflen += 1;
   }
 }
 
@@ -340,10 +835,6 @@ void setup()
   SERIAL_ECHO(freeMemory());
   SERIAL_ECHOPGM(MSG_PLANNER_BUFFER_BYTES);
   SERIAL_ECHOLN((int)sizeof(block_t)*BLOCK_BUFFER_SIZE);
-  for(int8_t i = 0; i < BUFSIZE; i++)
-  {
-    fromsd[i] = false;
-  }
   
   EEPROM_RetrieveSettings(); // loads data from EEPROM if available
 
@@ -370,22 +861,160 @@ void setup()
 }
 
 
+#if TEMP_0_PIN > -1
+// Prints the temperature and target of hotend e and of the bed, for M105 and the reports of M155
+static void print_temperatures(uint8_t e)
+{
+  SERIAL_PROTOCOLPGM("T:");
+  SERIAL_PROTOCOL_F(degHotend(e),1); 
+  SERIAL_PROTOCOLPGM(" /");
+  SERIAL_PROTOCOL_F(degTargetHotend(e),1); 
+  #if TEMP_BED_PIN > -1
+    SERIAL_PROTOCOLPGM(" B:");  
+    SERIAL_PROTOCOL_F(degBed(),1);
+    SERIAL_PROTOCOLPGM(" /");
+    SERIAL_PROTOCOL_F(degTargetBed(),1);
+  #endif //TEMP_BED_PIN
+}
+#endif
+
+#ifdef AUTO_REPORT_TEMPERATURES
+// Called by loop(), sends the temperatures every temperature_report_interval seconds. They are the last readings
+// the temperature interrupt took, nothing is measured for the report.
+static void report_temperatures()
+{
+  if(temperature_report_interval == 0 || (long)(millis() - next_temperature_report) < 0) return;
+  next_temperature_report = millis() + temperature_report_interval * 1000UL;
+  #if TEMP_0_PIN > -1
+    print_temperatures(active_extruder);
+    #ifdef PIDTEMP
+      SERIAL_PROTOCOLPGM(" @:");
+      SERIAL_PROTOCOL(getHeaterPower(active_extruder));  
+    #endif
+    SERIAL_PROTOCOLLN("");
+  #endif
+}
+#endif
+
+// Starts the wait of M109 or a tool change for hotend e to reach its target
+static void start_hotend_wait(uint8_t e)
+{
+  temp_wait = WAIT_HOTEND;
+  wait_extruder = e;
+  wait_heating = isHeatingHotend(e); // true if heating, false if cooling
+  #ifdef TEMP_RESIDENCY_TIME
+    residency_start = -1;
+  #endif
+  wait_report = millis();
+}
+
+// Called by loop() instead of executing the next command while temp_wait is set. Reports the temperature every
+// second and ends the wait once the target is reached, the waiting command then gets its ok.
+static void check_temp_wait()
+{
+  bool done;
+  if(Stopped) // The heaters were turned off by an error, the target will never be reached
+  {
+    temp_wait = WAIT_NONE;
+    ClearToSend();
+    return;
+  }
+  #if TEMP_BED_PIN > -1
+  if(temp_wait == WAIT_BED)
+  {
+    done = !isHeatingBed();
+    if(!done && (millis() - wait_report) > 1000) //Print Temp Reading every 1 second while heating up.
+    {
+      float tt=degHotend(active_extruder);
+      SERIAL_PROTOCOLPGM("T:");
+      SERIAL_PROTOCOL(tt);
+      SERIAL_PROTOCOLPGM(" E:");
+      SERIAL_PROTOCOL((int)active_extruder); 
+      SERIAL_PROTOCOLPGM(" B:");
+      SERIAL_PROTOCOL_F(degBed(),1); 
+      SERIAL_PROTOCOLLN(""); 
+      wait_report = millis(); 
+    }
+    if(!done) return;
+    temp_wait = WAIT_NONE;
+    LCD_MESSAGEPGM(MSG_BED_DONE);
+    ClearToSend();
+    return;
+  }
+  #endif
+  uint8_t t_ext = wait_extruder;
+  #ifdef TEMP_RESIDENCY_TIME
+    /* start/restart the TEMP_RESIDENCY_TIME timer whenever we reach target temp for the first time
+      or when current temp falls outside the hysteresis after target temp was reached */
+    if ((residency_start == -1 &&  wait_heating && (degHotend(t_ext) >= (degTargetHotend(t_ext)-TEMP_WINDOW))) ||
+        (residency_start == -1 && !wait_heating && (degHotend(t_ext) <= (degTargetHotend(t_ext)+TEMP_WINDOW))) ||
+        (residency_start > -1 && labs(degHotend(t_ext) - degTargetHotend(t_ext)) > TEMP_HYSTERESIS) ) 
+    {
+      residency_start = millis();
+    }
+    /* done once TEMP_RESIDENCY_TIME has passed since the target temp was reached */
+    done = residency_start >= 0 && (millis() - residency_start) >= (TEMP_RESIDENCY_TIME * 1000UL);
+  #else
+    done = !(wait_heating ? isHeatingHotend(t_ext) : (isCoolingHotend(t_ext)&&(CooldownNoWait==false)));
+  #endif //TEMP_RESIDENCY_TIME
+  if(!done && (millis() - wait_report) > 1000UL)
+  { //Print Temp Reading and remaining time every 1 second while heating up/cooling down
+    SERIAL_PROTOCOLPGM("T:");
+    SERIAL_PROTOCOL_F(degHotend(t_ext),1); 
+    SERIAL_PROTOCOLPGM(" E:");
+    SERIAL_PROTOCOL( (int)t_ext ); 
+    #ifdef TEMP_RESIDENCY_TIME
+      SERIAL_PROTOCOLPGM(" W:");
+      if(residency_start > -1)
+      {
+         SERIAL_PROTOCOLLN( ((TEMP_RESIDENCY_TIME * 1000UL) - (millis() - residency_start)) / 1000UL );
+      } else 
+      {
+         SERIAL_PROTOCOLLN( "?" );
+      }
+    #else
+      SERIAL_PROTOCOLLN("");
+    #endif
+    wait_report = millis();
+  }
+  if(!done) return;
+  temp_wait = WAIT_NONE;
+  LCD_MESSAGEPGM(MSG_HEATING_COMPLETE);
+  starttime=millis();
+  ClearToSend();
+}
+
 void loop()
 {
-  if(buflen < (BUFSIZE-1))
-    get_command();
+  // Apply a new speed override (M220 or the LCD) to the moves that are already planned
+  int new_feedmultiply = feedmultiply;
+  if(new_feedmultiply != planned_feedmultiply && new_feedmultiply > 0)
+  {
+    mc_flush_line();
+    plan_scale_feed_rate((float)new_feedmultiply/planned_feedmultiply);
+    planned_feedmultiply = new_feedmultiply;
+  }
+  get_command();
   #ifdef SDSUPPORT
     card.checkautostart(false);
   #endif
   if(buflen)
   {
+    if(CMD_QUEUE_SIZE - cmd_queue_tail < sizeof(cmd_header_t) ||
+       ((cmd_header_t *)&cmd_queue[cmd_queue_tail])->command == CMD_END)
+      cmd_queue_tail = 0;
+    current_cmd = (cmd_header_t *)&cmd_queue[cmd_queue_tail];
+    unsigned char size = command_size(current_cmd);
+    if(temp_wait != WAIT_NONE)
+      check_temp_wait();
+    else
     #ifdef SDSUPPORT
       if(card.saving)
       {
-	if(strstr(cmdbuffer[bufindr],"M29") == NULL)
+	if(command_code(current_cmd) != 'M' || command_number(current_cmd) != 29)
 	{
-	  card.write_command(cmdbuffer[bufindr]);
-	  SERIAL_PROTOCOLLNPGM(MSG_OK);
+	  card.write_command(command_text(current_cmd));
+	  send_ok();
 	}
 	else
 	{
@@ -400,11 +1029,22 @@ void loop()
     #else
       process_commands();
     #endif //SDSUPPORT
-    buflen = (buflen-1);
-    bufindr = (bufindr + 1)%BUFSIZE;
+    // A command that waits for a temperature stays at the tail of cmd_queue until the wait ends
+    if(temp_wait == WAIT_NONE)
+    {
+      cmd_queue_tail += size;
+      buflen = (buflen-1);
+    }
+    current_cmd = NULL;
   }
+  // Don't hold back a merged move while the planner runs dry waiting for more commands
+  if(!buflen && movesplanned() < 2)
+    mc_flush_line();
   //check heater every n milliseconds
   manage_heater();
+  #ifdef AUTO_REPORT_TEMPERATURES
+    report_temperatures();
+  #endif
   manage_inactivity(1);
   checkHitEndstops();
   LCD_STATUS;
@@ -413,7 +1053,24 @@ void loop()
 
 void get_command() 
 { 
-  while( MYSERIAL.available() > 0  && buflen < BUFSIZE) {
+  if(line_pending) {
+    #ifdef BINARY_PROTOCOL
+    if(binary_mode && !(line_flags & CMD_FROM_SD))
+      queue_frame();
+    else
+    #endif
+    queue_line();
+    if(line_pending) return;
+  }
+  #ifdef SELECTIVE_RESEND
+  if(!release_held_lines()) return;
+  #endif
+  #ifdef BINARY_PROTOCOL
+  if(binary_mode)
+    get_binary_frames();
+  else
+  #endif
+  while( MYSERIAL.available() > 0  && !line_pending) {
     serial_char = MYSERIAL.read();
     if(serial_char == '\n' || 
        serial_char == '\r' || 
@@ -424,15 +1081,17 @@ void get_command()
         comment_mode = false; //for new command
         return;
       }
-      cmdbuffer[bufindw][serial_count] = 0; //terminate string
+      cmdline[serial_count] = 0; //terminate string
       if(!comment_mode){
         comment_mode = false; //for new command
-        fromsd[bufindw] = false;
-        if(strstr(cmdbuffer[bufindw], "N") != NULL)
+        if(strchr(cmdline, 'N') != NULL)
         {
-          strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-          gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
-          if(gcode_N != gcode_LastN+1 && (strstr(cmdbuffer[bufindw], "M110") == NULL) ) {
+          strchr_pointer = strchr(cmdline, 'N');
+          gcode_N = parse_long(strchr_pointer + 1);
+          bool set_line_number = (strstr(cmdline, "M110") != NULL);
+          #ifndef SELECTIVE_RESEND
+          if(gcode_N != gcode_LastN+1 && !set_line_number) {
+            line_number_errors++;
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
             SERIAL_ERRORLN(gcode_LastN);
@@ -441,19 +1100,25 @@ void get_command()
             serial_count = 0;
             return;
           }
+          #endif
 
-          if(strstr(cmdbuffer[bufindw], "*") != NULL)
+          if(strchr(cmdline, '*') != NULL)
           {
             byte checksum = 0;
             byte count = 0;
-            while(cmdbuffer[bufindw][count] != '*') checksum = checksum^cmdbuffer[bufindw][count++];
-            strchr_pointer = strchr(cmdbuffer[bufindw], '*');
+            while(cmdline[count] != '*') checksum = checksum^cmdline[count++];
 
-            if( (int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum) {
+            if( (int)parse_long(&cmdline[count + 1]) != checksum) {
+              checksum_errors++;
               SERIAL_ERROR_START;
               SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
               SERIAL_ERRORLN(gcode_LastN);
-              FlushSerialRequestResend();
+              #ifdef SELECTIVE_RESEND
+                // Keep the lines behind it, only the broken one is sent again
+                request_broken_line();
+              #else
+                FlushSerialRequestResend();
+              #endif
               serial_count = 0;
               return;
             }
@@ -461,20 +1126,31 @@ void get_command()
           }
           else 
           {
+            checksum_errors++;
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_NO_CHECKSUM);
             SERIAL_ERRORLN(gcode_LastN);
-            FlushSerialRequestResend();
+            #ifdef SELECTIVE_RESEND
+              request_broken_line();
+            #else
+              FlushSerialRequestResend();
+            #endif
             serial_count = 0;
             return;
           }
 
+          #ifdef SELECTIVE_RESEND
+          if(!sort_line(set_line_number)) {
+            serial_count = 0;
+            return;
+          }
+          #endif
           gcode_LastN = gcode_N;
           //if no errors, continue parsing
         }
         else  // if we don't receive 'N' but still see '*'
         {
-          if((strstr(cmdbuffer[bufindw], "*") != NULL))
+          if(strchr(cmdline, '*') != NULL)
           {
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
@@ -483,46 +1159,26 @@ void get_command()
             return;
           }
         }
-        if((strstr(cmdbuffer[bufindw], "G") != NULL)){
-          strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-          switch((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)))){
-          case 0:
-          case 1:
-          case 2:
-          case 3:
-            if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
-	      #ifdef SDSUPPORT
-              if(card.saving)
-                break;
-	      #endif //SDSUPPORT
-              SERIAL_PROTOCOLLNPGM(MSG_OK); 
-            }
-            else {
-              SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-              LCD_MESSAGEPGM(MSG_STOPPED);
-            }
-            break;
-          default:
-            break;
-          }
-
-        }
-        bufindw = (bufindw + 1)%BUFSIZE;
-        buflen += 1;
+        line_flags = 0;
+        queue_line();
+        if(line_pending) return;
+        #ifdef SELECTIVE_RESEND
+        if(!release_held_lines()) return;
+        #endif
       }
       serial_count = 0; //clear buffer
     }
     else
     {
       if(serial_char == ';') comment_mode = true;
-      if(!comment_mode) cmdbuffer[bufindw][serial_count++] = serial_char;
+      if(!comment_mode) cmdline[serial_count++] = serial_char;
     }
   }
   #ifdef SDSUPPORT
   if(!card.sdprinting || serial_count!=0){
     return;
   }
-  while( !card.eof()  && buflen < BUFSIZE) {
+  while( !card.eof()  && !line_pending) {
     int16_t n=card.get();
     serial_char = (char)n;
     if(serial_char == '\n' || 
@@ -551,19 +1207,19 @@ void get_command()
         comment_mode = false; //for new command
         return; //if empty line
       }
-      cmdbuffer[bufindw][serial_count] = 0; //terminate string
+      cmdline[serial_count] = 0; //terminate string
 //      if(!comment_mode){
-        fromsd[bufindw] = true;
-        buflen += 1;
-        bufindw = (bufindw + 1)%BUFSIZE;
+        line_flags = CMD_FROM_SD;
+        comment_mode = false; //for new command
+        queue_line();
+        if(line_pending) return;
 //      }     
-      comment_mode = false; //for new command
       serial_count = 0; //clear buffer
     }
     else
     {
       if(serial_char == ';') comment_mode = true;
-      if(!comment_mode) cmdbuffer[bufindw][serial_count++] = serial_char;
+      if(!comment_mode) cmdline[serial_count++] = serial_char;
     }
   }
   
@@ -574,23 +1230,40 @@ void get_command()
 
 float code_value() 
 { 
-  return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL)); 
+  if(!seen_in_text) return seen_value;
+  return parse_float(strchr_pointer + 1);
 }
 
 long code_value_long() 
 { 
-  return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10)); 
+  if(!seen_in_text) return seen_value;
+  return parse_long(strchr_pointer + 1);
 }
 
 bool code_seen(char code_string[]) //Return True if the string was found
 { 
-  return (strstr(cmdbuffer[bufindr], code_string) != NULL); 
+  return (command_flags(current_cmd) & CMD_HAS_TEXT) && strstr(command_text(current_cmd), code_string) != NULL; 
 }  
 
 bool code_seen(char code)
 {
-  strchr_pointer = strchr(cmdbuffer[bufindr], code);
-  return (strchr_pointer != NULL);  //Return True if a character was found
+  seen_in_text = (command_flags(current_cmd) & CMD_HAS_TEXT) != 0;
+  if(seen_in_text) {
+    strchr_pointer = strchr(command_text(current_cmd), code);
+    return (strchr_pointer != NULL);  //Return True if a character was found
+  }
+  if(code == command_code(current_cmd)) {
+    seen_value = command_number(current_cmd);
+    return true;
+  }
+  if(code < 'A' || code > 'Z') return false;
+  unsigned long bit = 1UL << (code - 'A');
+  if(!(current_cmd->letters & bit)) return false;
+  // The values are in alphabetic order, the number of letters before this one is its index
+  unsigned char index = 0;
+  for(unsigned long before = current_cmd->letters & (bit - 1); before != 0; before &= before - 1) index++;
+  seen_value = ((float *)(current_cmd + 1))[index];
+  return true;
 }
 
 #define HOMEAXIS(LETTER) \
@@ -620,70 +1293,15 @@ bool code_seen(char code)
     endstops_hit_on_purpose();\
   }
   
-void wait_for_temp(uint8_t& t_ext, unsigned long& codenum)
-{
-        /* See if we are heating up or cooling down */
-      bool target_direction = isHeatingHotend(t_ext); // true if heating, false if cooling
-
-      #ifdef TEMP_RESIDENCY_TIME
-        long residencyStart;
-        residencyStart = -1;
-        /* continue to loop until we have reached the target temp   
-          _and_ until TEMP_RESIDENCY_TIME hasn't passed since we reached it */
-        while((residencyStart == -1) ||
-              (residencyStart >= 0 && (((unsigned int) (millis() - residencyStart)) < (TEMP_RESIDENCY_TIME * 1000UL))) ) 
-        {
-      #else
-        while ( target_direction ? (isHeatingHotend(t_ext)) : (isCoolingHotend(tmp_extruder)&&(CooldownNoWait==false)) ) 
-        {
-      #endif //TEMP_RESIDENCY_TIME
-          if( (millis() - codenum) > 1000UL )
-          { //Print Temp Reading and remaining time every 1 second while heating up/cooling down
-            SERIAL_PROTOCOLPGM("T:");
-            SERIAL_PROTOCOL_F(degHotend(t_ext),1); 
-            SERIAL_PROTOCOLPGM(" E:");
-            SERIAL_PROTOCOL( (int)t_ext ); 
-            #ifdef TEMP_RESIDENCY_TIME
-              SERIAL_PROTOCOLPGM(" W:");
-              if(residencyStart > -1)
-              {
-                 codenum = ((TEMP_RESIDENCY_TIME * 1000UL) - (millis() - residencyStart)) / 1000UL;
-                 SERIAL_PROTOCOLLN( codenum );
-              } else 
-              {
-                 SERIAL_PROTOCOLLN( "?" );
-              }
-            #else
-              SERIAL_PROTOCOLLN("");
-            #endif
-            codenum = millis();
-          }
-          manage_heater();
-          manage_inactivity(1);
-          lcd_status();
-          led_status();
-        #ifdef TEMP_RESIDENCY_TIME
-            /* start/restart the TEMP_RESIDENCY_TIME timer whenever we reach target temp for the first time
-              or when current temp falls outside the hysteresis after target temp was reached */
-          if ((residencyStart == -1 &&  target_direction && (degHotend(t_ext) >= (degTargetHotend(t_ext)-TEMP_WINDOW))) ||
-              (residencyStart == -1 && !target_direction && (degHotend(t_ext) <= (degTargetHotend(t_ext)+TEMP_WINDOW))) ||
-              (residencyStart > -1 && labs(degHotend(t_ext) - degTargetHotend(t_ext)) > TEMP_HYSTERESIS) ) 
-          {
-            residencyStart = millis();
-          }
-        #endif //TEMP_RESIDENCY_TIME
-        }
-        LCD_MESSAGEPGM(MSG_HEATING_COMPLETE);
-        starttime=millis();
-        previous_millis_cmd = millis();
-}
-  
-
 void process_commands()
 {
   unsigned long codenum; //throw away variable
   char *starpos = NULL;
 
+  // Only consecutive G0/G1 moves are merged, everything else has to see the moves before it executed
+  if(!code_seen('G') || (int)code_value() > 1)
+    mc_flush_line();
+
   if(code_seen('G'))
   {
     switch((int)code_value())
@@ -692,7 +1310,7 @@ void process_commands()
     case 1: // G1
       if(Stopped == false) {
         get_coordinates(); // For X Y Z E F
-        prepare_move();
+        prepare_move(true);
         //ClearToSend();
         return;
       }
@@ -715,13 +1333,9 @@ void process_commands()
       if(code_seen('P')) codenum = code_value(); // milliseconds to wait
       if(code_seen('S')) codenum = code_value() * 1000; // seconds to wait
       
-      st_synchronize();
-      codenum += millis();  // keep track of when we started waiting
+      // The stepper interrupt waits when it gets to the dwell, the moves after it are planned meanwhile
+      if(codenum > 0) plan_buffer_dwell(codenum);
       previous_millis_cmd = millis();
-      while(millis()  < codenum ){
-        manage_heater();
-        manage_inactivity(1);
-      }
       break;
       
       case 10: // Set offsets
@@ -894,7 +1508,7 @@ void process_commands()
     case 28: //M28 - Start SD write
       starpos = (strchr(strchr_pointer + 4,'*'));
       if(starpos != NULL){
-        char* npos = strchr(cmdbuffer[bufindr], 'N');
+        char* npos = strchr(command_text(current_cmd), 'N');
         strchr_pointer = strchr(npos,' ') + 1;
         *(starpos-1) = '\0';
       }
@@ -909,7 +1523,7 @@ void process_commands()
 		card.closefile();
 		starpos = (strchr(strchr_pointer + 4,'*'));
                 if(starpos != NULL){
-                char* npos = strchr(cmdbuffer[bufindr], 'N');
+                char* npos = strchr(command_text(current_cmd), 'N');
                 strchr_pointer = strchr(npos,' ') + 1;
                 *(starpos-1) = '\0';
          }
@@ -986,6 +1600,14 @@ void process_commands()
     case 140: // M140 set bed temp
       if (code_seen('S')) setTargetBed(code_value());
       break;
+    #ifdef AUTO_REPORT_TEMPERATURES
+    case 155: // M155 S<seconds> between temperature reports, S0 for none
+      if (code_seen('S')) {
+        temperature_report_interval = constrain(code_value(), 0, 60);
+        next_temperature_report = millis();
+      }
+      break;
+    #endif
     case 1105:
       #if (TEMP_0_PIN > -1)
         SERIAL_PROTOCOLPGM("ok T0 raw:");
@@ -1008,16 +1630,8 @@ void process_commands()
         }
       }
       #if (TEMP_0_PIN > -1)
-        SERIAL_PROTOCOLPGM("ok T:");
-        SERIAL_PROTOCOL_F(degHotend(tmp_extruder),1); 
-        SERIAL_PROTOCOLPGM(" /");
-        SERIAL_PROTOCOL_F(degTargetHotend(tmp_extruder),1); 
-        #if TEMP_BED_PIN > -1
-          SERIAL_PROTOCOLPGM(" B:");  
-          SERIAL_PROTOCOL_F(degBed(),1);
-          SERIAL_PROTOCOLPGM(" /");
-          SERIAL_PROTOCOL_F(degTargetBed(),1);
-        #endif //TEMP_BED_PIN
+        SERIAL_PROTOCOLPGM("ok ");
+        print_temperatures(tmp_extruder);
       #else
         SERIAL_ERROR_START;
         SERIAL_ERRORLNPGM(MSG_ERR_NO_THERMISTORS);
@@ -1050,34 +1664,14 @@ void process_commands()
       }
       
       
-      codenum = millis(); 
-      wait_for_temp(tmp_extruder, codenum);
+      start_hotend_wait(tmp_extruder);
       break;
     case 190: // M190 - Wait for bed heater to reach target.
     #if TEMP_BED_PIN > -1
         LCD_MESSAGEPGM(MSG_BED_HEATING);
         if (code_seen('S')) setTargetBed(code_value());
-        codenum = millis(); 
-        while(isHeatingBed()) 
-        {
-          if(( millis() - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up.
-          {
-            float tt=degHotend(active_extruder);
-            SERIAL_PROTOCOLPGM("T:");
-            SERIAL_PROTOCOL(tt);
-            SERIAL_PROTOCOLPGM(" E:");
-            SERIAL_PROTOCOL((int)active_extruder); 
-            SERIAL_PROTOCOLPGM(" B:");
-            SERIAL_PROTOCOL_F(degBed(),1); 
-            SERIAL_PROTOCOLLN(""); 
-            codenum = millis(); 
-          }
-          manage_heater();
-          manage_inactivity(1);
-          LCD_STATUS;
-        }
-        LCD_MESSAGEPGM(MSG_BED_DONE);
-        previous_millis_cmd = millis();
+        temp_wait = WAIT_BED;
+        wait_report = millis();
     #endif
         break;
 
@@ -1150,7 +1744,7 @@ void process_commands()
       SerialprintPGM(MSG_M115_REPORT);
       break;
     case 117: // M117 display message
-      LCD_MESSAGE(cmdbuffer[bufindr]+5);
+      LCD_MESSAGE(command_text(current_cmd)+5);
       break;
     case 114: // M114
       SERIAL_PROTOCOLPGM("X:");
@@ -1226,10 +1820,15 @@ void process_commands()
         if(code_seen(axis_codes[i])) max_feedrate[i] = code_value();
       }
       break;
-    case 204: // M204 acclereration S normal moves T filmanent only moves
+    case 204: // M204 acclereration P printing moves R filmanent only moves T travel moves S printing and travel moves
       {
-        if(code_seen('S')) acceleration = code_value() ;
-        if(code_seen('T')) retract_acceleration = code_value() ;
+        if(code_seen('S')) {
+          acceleration = code_value() ;
+          travel_acceleration = acceleration;
+        }
+        if(code_seen('P')) acceleration = code_value() ;
+        if(code_seen('R')) retract_acceleration = code_value() ;
+        if(code_seen('T')) travel_acceleration = code_value() ;
       }
       break;
     case 205: //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk
@@ -1240,6 +1839,8 @@ void process_commands()
       if(code_seen('X')) max_xy_jerk = code_value() ;
       if(code_seen('Z')) max_z_jerk = code_value() ;
       if(code_seen('E')) max_e_jerk = code_value() ;
+      if(code_seen('C')) cornering_mode = code_value_long() ? CORNERING_JUNCTION_DEVIATION : CORNERING_JERK;
+      if(code_seen('J')) junction_deviation = code_value() ;
       #ifdef ADVANCE
       if(code_seen('K')) advance_k = code_value() ;
       #endif
@@ -1414,6 +2015,42 @@ void process_commands()
       SERIAL_ECHO(freeMemory());
     }
     break;
+    case 529: // M529 report serial line errors, R resets the counters
+    {
+      SERIAL_ECHO_START;
+      SERIAL_ECHOPGM("Checksum errors:");
+      SERIAL_ECHO(checksum_errors);
+      SERIAL_ECHOPGM(" Line number errors:");
+      SERIAL_ECHO(line_number_errors);
+      SERIAL_ECHOPGM(" Resends:");
+      SERIAL_ECHO(resend_requests);
+      #ifdef SELECTIVE_RESEND
+        SERIAL_ECHOPGM(" Held:");
+        SERIAL_ECHO(lines_held);
+        SERIAL_ECHOPGM(" Skipped:");
+        SERIAL_ECHO(lines_skipped);
+      #endif
+      SERIAL_ECHOLN("");
+      if(code_seen('R')) {
+        checksum_errors = line_number_errors = resend_requests = 0;
+        #ifdef SELECTIVE_RESEND
+          lines_held = lines_skipped = 0;
+        #endif
+      }
+    }
+    break;
+    #ifdef BINARY_PROTOCOL
+    case 530: // M530 S1 switch the serial port to binary frames after the ok, S0 back to lines
+      if(code_seen('S')) {
+        binary_mode = (code_value() != 0);
+        binary_seq = 0;
+        binary_resend_sent = false;
+        memset(binary_values, 0, sizeof(binary_values));
+        serial_count = 0;
+        comment_mode = false;
+      }
+    break;
+    #endif
     case 999: // Restart after being stopped
       Stopped = false;
       gcode_LastN = Stopped_gcode_LastN;
@@ -1522,8 +2159,7 @@ void process_commands()
       setTargetHotend(extruder_temperature[active_extruder], active_extruder);
       
       
-      codenum = millis(); 
-      wait_for_temp(active_extruder, codenum);
+      start_hotend_wait(active_extruder);
       }
     }
   }
@@ -1533,17 +2169,20 @@ void process_commands()
   {
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM(MSG_UNKNOWN_COMMAND);
-    SERIAL_ECHO(cmdbuffer[bufindr]);
+    SERIAL_ECHO(command_text(current_cmd));
     SERIAL_ECHOLNPGM("\"");
   }
 
-  ClearToSend();
+  // A temperature wait sends its ok when it ends
+  if(temp_wait == WAIT_NONE)
+    ClearToSend();
 }
 
 void FlushSerialRequestResend()
 {
   //char cmdbuffer[bufindr][100]="Resend:";
   MYSERIAL.flush();
+  resend_requests++;
   SERIAL_PROTOCOLPGM(MSG_RESEND);
   SERIAL_PROTOCOLLN(gcode_LastN + 1);
   ClearToSend();
@@ -1553,10 +2192,10 @@ void ClearToSend()
 {
   previous_millis_cmd = millis();
   #ifdef SDSUPPORT
-  if(fromsd[bufindr])
+  if(current_cmd != NULL && (command_flags(current_cmd) & CMD_FROM_SD))
     return;
   #endif //SDSUPPORT
-  SERIAL_PROTOCOLLNPGM(MSG_OK); 
+  send_ok();
 }
 
 void get_coordinates()
@@ -1588,7 +2227,7 @@ void get_arc_coordinates()
    }
 }
 
-void prepare_move()
+void prepare_move(bool coalesce)
 {
 
 // transform destination *********************************************
@@ -1607,7 +2246,10 @@ void prepare_move()
     if (modified_destination[Z_AXIS] > max_length[Z_AXIS]) modified_destination[Z_AXIS] = max_length[Z_AXIS];
   }
   previous_millis_cmd = millis();  
-  plan_buffer_line(modified_destination[X_AXIS], modified_destination[Y_AXIS], modified_destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
+  if (coalesce)
+    mc_line(modified_destination[X_AXIS], modified_destination[Y_AXIS], modified_destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
+  else
+    plan_buffer_line(modified_destination[X_AXIS], modified_destination[Y_AXIS], modified_destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
   for(int8_t i=0; i < NUM_AXIS; i++) {
     current_position[i] = destination[i];
   }
@@ -1711,6 +2353,7 @@ void kill()
 void Stop()
 {
   disable_heater();
+  mc_discard_line();
   if(Stopped == false) {
     Stopped = true;
     Stopped_gcode_LastN = gcode_LastN; // Save last g_code for restart
@@ -35,11 +35,12 @@
 
 #if defined(UBRRH) || defined(UBRR0H)
   ring_buffer rx_buffer  =  { { 0 }, 0, 0 };
+  tx_ring_buffer tx_buffer  =  { { 0 }, 0, 0 };
 #endif
 
 FORCE_INLINE void store_char(unsigned char c)
 {
-  int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
+  unsigned char i = (rx_buffer.head + 1) & (RX_BUFFER_SIZE - 1);
 
   // if we should be storing the received character into the location
   // just before the tail (meaning that the head would advance to the
@@ -67,7 +68,34 @@ FORCE_INLINE void store_char(unsigned char c)
   #endif
     store_char(c);
   }
+#elif defined(USART_RX_vect)
+  // atmega168/328
+  SIGNAL(USART_RX_vect)
+  {
+    store_char(UDR0);
+  }
+#endif
+
+// Sends the oldest byte of the transmit buffer. The data register must be empty.
+FORCE_INLINE void send_tx_char()
+{
+  UDR0 = tx_buffer.buffer[tx_buffer.tail];
+  tx_buffer.tail = (tx_buffer.tail + 1) & (TX_BUFFER_SIZE - 1);
+}
+
+#if defined(USART0_UDRE_vect)
+  ISR(USART0_UDRE_vect)
+#else
+  ISR(USART_UDRE_vect)
 #endif
+{
+  if (tx_buffer.head != tx_buffer.tail) {
+    send_tx_char();
+  }
+  if (tx_buffer.head == tx_buffer.tail) {
+    cbi(UCSR0B, UDRIE0); // Nothing left to send
+  }
+}
 
 // Constructors ////////////////////////////////////////////////////////////////
 
@@ -104,6 +132,7 @@ void MarlinSerial::begin(long baud)
   UBRR0H = baud_setting >> 8;
   UBRR0L = baud_setting;
 
+  tx_buffer.head = tx_buffer.tail;
   sbi(UCSR0B, RXEN0);
   sbi(UCSR0B, TXEN0);
   sbi(UCSR0B, RXCIE0);
@@ -114,6 +143,43 @@ void MarlinSerial::end()
   cbi(UCSR0B, RXEN0);
   cbi(UCSR0B, TXEN0);
   cbi(UCSR0B, RXCIE0);  
+  cbi(UCSR0B, UDRIE0);
+}
+
+void MarlinSerial::write(uint8_t c)
+{
+  if ((SREG & (1 << SREG_I)) == 0) {
+    // The interrupt can't empty the buffer now, e.g. in kill() or when called from an interrupt. Send the
+    // waiting bytes and this one directly.
+    while (tx_buffer.head != tx_buffer.tail) {
+      while (!((UCSR0A) & (1 << UDRE0)))
+        ;
+      send_tx_char();
+    }
+    while (!((UCSR0A) & (1 << UDRE0)))
+      ;
+    UDR0 = c;
+    return;
+  }
+
+  // Nothing waiting and the data register is empty, send it right away. With interrupts off, so an interrupt
+  // that writes to the port itself can't fill the register between the test and the write, which would lose c.
+  unsigned char old_sreg = SREG;
+  cli();
+  if ((tx_buffer.head == tx_buffer.tail) && ((UCSR0A) & (1 << UDRE0))) {
+    UDR0 = c;
+    SREG = old_sreg;
+    return;
+  }
+  SREG = old_sreg;
+
+  unsigned char i = (tx_buffer.head + 1) & (TX_BUFFER_SIZE - 1);
+  // Only wait if the buffer is full
+  while (i == tx_buffer.tail)
+    ;
+  tx_buffer.buffer[tx_buffer.head] = c;
+  tx_buffer.head = i;
+  sbi(UCSR0B, UDRIE0);
 }
 
 
@@ -134,7 +200,7 @@ int MarlinSerial::read(void)
     return -1;
   } else {
     unsigned char c = rx_buffer.buffer[rx_buffer.tail];
-    rx_buffer.tail = (unsigned int)(rx_buffer.tail + 1) % RX_BUFFER_SIZE;
+    rx_buffer.tail = (rx_buffer.tail + 1) & (RX_BUFFER_SIZE - 1);
     return c;
   }
 }
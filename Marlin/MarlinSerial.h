@@ -39,18 +39,34 @@
 // using a ring buffer (I think), in which rx_buffer_head is the index of the
 // location to which to write the next incoming character and rx_buffer_tail
 // is the index of the location from which to read.
-#define RX_BUFFER_SIZE 128
-
+// The receive interrupt fills it, RX_BUFFER_SIZE is set in Configuration_adv.h.
+#if (RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) != 0 || RX_BUFFER_SIZE > 256
+  #error RX_BUFFER_SIZE must be a power of 2 of at most 256
+#endif
 
 struct ring_buffer
 {
   unsigned char buffer[RX_BUFFER_SIZE];
-  int head;
-  int tail;
+  volatile unsigned char head; // Single bytes, so they are read and written atomically
+  volatile unsigned char tail;
+};
+
+// Bytes waiting to be sent, the data register empty interrupt sends them. TX_BUFFER_SIZE is set in
+// Configuration_adv.h.
+#if (TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) != 0 || TX_BUFFER_SIZE > 256
+  #error TX_BUFFER_SIZE must be a power of 2 of at most 256
+#endif
+
+struct tx_ring_buffer
+{
+  unsigned char buffer[TX_BUFFER_SIZE];
+  volatile unsigned char head;
+  volatile unsigned char tail;
 };
 
 #if defined(UBRRH) || defined(UBRR0H)
   extern ring_buffer rx_buffer;
+  extern tx_ring_buffer tx_buffer;
 #endif
 
 class MarlinSerial //: public Stream
@@ -66,34 +82,10 @@ class MarlinSerial //: public Stream
     
     FORCE_INLINE int available(void)
     {
-      return (unsigned int)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
+      return (unsigned char)(rx_buffer.head - rx_buffer.tail) & (RX_BUFFER_SIZE - 1);
     }
     
-    FORCE_INLINE void write(uint8_t c)
-    {
-      while (!((UCSR0A) & (1 << UDRE0)))
-        ;
-
-      UDR0 = c;
-    }
-    
-    
-    FORCE_INLINE void checkRx(void)
-    {
-      if((UCSR0A & (1<<RXC0)) != 0) {
-        unsigned char c  =  UDR0;
-        int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
-
-        // if we should be storing the received character into the location
-        // just before the tail (meaning that the head would advance to the
-        // current location of the tail), we're about to overflow the buffer
-        // and so we don't write the character or advance the head.
-        if (i != rx_buffer.tail) {
-          rx_buffer.buffer[rx_buffer.head] = c;
-          rx_buffer.head = i;
-        }
-      }
-    }
+    void write(uint8_t c);
     
     
     private:
@@ -0,0 +1,483 @@
+#!/usr/bin/env python
+
+""" Send g-code to Marlin over the binary protocol of BINARY_PROTOCOL (M530), or check the encoder and decoder
+against a simulated printer on a pseudo terminal with --loopback (Linux). test/binary_frames runs the firmware's
+own decoder on the host and sends to it with this script. """
+
+from __future__ import print_function
+
+import argparse
+import os
+import random
+import re
+import select
+import sys
+import termios
+import threading
+import time
+import tty
+
+__license__ = "GPL"
+
+SYNC = 0xa5
+TEXT = 1
+MOVE = 2
+G0 = 0x80
+FIELDS = 'XYZEF'
+SCALES = [1000, 1000, 1000, 100000, 1000]
+DECIMALS = [3, 3, 3, 5, 3]
+MAX_CMD_SIZE = 96
+MAX_PAYLOAD = MAX_CMD_SIZE - 6
+WORD = re.compile(r'([A-Z])([-+]?(?:\d+\.?\d*|\.\d+))?')
+NUMBER = re.compile(r'^[-+]?(?:\d+\.?\d*|\.\d+)$')
+
+
+def crc16(data, crc=0xffff):
+    """ CRC16 XMODEM, the same as _crc_xmodem_update() of avr-libc. """
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+        crc &= 0xffff
+    return crc
+
+
+def make_frame(seq, kind, payload):
+    body = bytearray([len(payload), seq & 0xff, kind]) + bytearray(payload)
+    crc = crc16(body)
+    return bytearray([SYNC]) + body + bytearray([crc & 0xff, crc >> 8])
+
+
+def strip_line(line):
+    """ The command without comment and surrounding white space. """
+    return line.split(';', 1)[0].strip()
+
+
+def parse_words(line):
+    """ Returns the code of a command like 'G1' and its parameters as a dict of floats, the first of each letter. """
+    code = None
+    params = {}
+    for letter, value in WORD.findall(line.upper()):
+        if code is None and letter in 'GMT' and value:
+            code = letter + str(int(float(value)))
+        elif letter != 'N' and letter not in params:
+            params[letter] = float(value) if value else 0.0
+    return code, params
+
+
+class Encoder(object):
+    """ Turns lines into frame payloads. G0 and G1 moves with only X, Y, Z, E and F become BINARY_MOVE payloads
+    if their values are exact in fixed point, everything else is sent as text. """
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.last = [0] * len(FIELDS)
+
+    def encode(self, line):
+        line = strip_line(line)
+        move = self.encode_move(line)
+        if move is not None:
+            return MOVE, move
+        text = bytearray(line.encode('ascii'))
+        if len(text) > MAX_PAYLOAD:
+            raise ValueError('line too long for a frame: ' + line)
+        return TEXT, text
+
+    def encode_move(self, line):
+        words = line.upper().split()
+        if not words or words[0] not in ('G0', 'G1', 'G00', 'G01'):
+            return None
+        values = [None] * len(FIELDS)
+        for word in words[1:]:
+            index = FIELDS.find(word[0])
+            if index < 0 or values[index] is not None or not NUMBER.match(word[1:]):
+                return None
+            decimals = word[1:].split('.')[1] if '.' in word else ''
+            if len(decimals.rstrip('0')) > DECIMALS[index]:
+                return None
+            fixed = int(round(float(word[1:]) * SCALES[index]))
+            if not -2**31 <= fixed < 2**31:
+                return None
+            values[index] = fixed
+        mask = G0 if words[0] in ('G0', 'G00') else 0
+        sizes = 0
+        fields = bytearray()
+        for index, fixed in enumerate(values):
+            if fixed is None:
+                continue
+            mask |= 1 << index
+            change = fixed - self.last[index]
+            if -128 <= change < 128:
+                fields += bytearray([change & 0xff])
+            elif -32768 <= change < 32768:
+                sizes |= 1 << (2 * index)
+                fields += bytearray([change & 0xff, (change >> 8) & 0xff])
+            else:
+                sizes |= 2 << (2 * index)
+                fields += bytearray([(fixed >> shift) & 0xff for shift in (0, 8, 16, 24)])
+            self.last[index] = fixed
+        return bytearray([mask, sizes & 0xff, sizes >> 8]) + fields
+
+
+class Decoder(object):
+    """ Does what the firmware does with the bytes it receives in binary mode: finds the frames, checks them and
+    decodes the moves. """
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.buffer = bytearray()
+        self.last = [0] * len(FIELDS)
+
+    def feed(self, data):
+        """ Yields (sequence number, type, payload) of the frames completed by data, None for a broken frame. """
+        for byte in bytearray(data):
+            if not self.buffer and byte != SYNC:
+                continue
+            if len(self.buffer) == 1 and byte > MAX_PAYLOAD:
+                self.buffer = bytearray()
+                continue
+            self.buffer.append(byte)
+            if len(self.buffer) < 2 or len(self.buffer) < self.buffer[1] + 6:
+                continue
+            frame, self.buffer = self.buffer, bytearray()
+            length = frame[1]
+            crc = crc16(frame[1:length + 4])
+            if frame[length + 4] != crc & 0xff or frame[length + 5] != crc >> 8:
+                self.broken = frame
+                yield None
+            else:
+                yield frame[2], frame[3], frame[4:length + 4]
+
+    @staticmethod
+    def move_length(payload):
+        if len(payload) < 3:
+            return 0
+        length = 3
+        sizes = payload[1] | payload[2] << 8
+        for index in range(len(FIELDS)):
+            if payload[0] & (1 << index):
+                if sizes & 3 == 3:
+                    return 0
+                length += 1 << (sizes & 3)
+            sizes >>= 2
+        return length
+
+    def decode_move(self, payload):
+        """ Returns the code and parameters of a checked move payload and takes over its values. """
+        sizes = payload[1] | payload[2] << 8
+        offset = 3
+        params = {}
+        for index in range(len(FIELDS)):
+            size = (sizes >> (2 * index)) & 3
+            if not payload[0] & (1 << index):
+                continue
+            raw = payload[offset:offset + (1 << size)]
+            offset += 1 << size
+            value = sum(byte << (8 * n) for n, byte in enumerate(raw))
+            if value >= 1 << (8 * len(raw) - 1):
+                value -= 1 << (8 * len(raw))
+            self.last[index] = value if size == 2 else self.last[index] + value
+            params[FIELDS[index]] = float(self.last[index]) / SCALES[index]
+        return ('G0' if payload[0] & G0 else 'G1'), params
+
+
+class Port(object):
+    """ Lines and bytes over a serial port or pseudo terminal, without pyserial. """
+
+    def __init__(self, fd, baud=None):
+        self.fd = fd
+        self.received = bytearray()
+        tty.setraw(fd)
+        if baud is not None:
+            attrs = termios.tcgetattr(fd)
+            attrs[4] = attrs[5] = getattr(termios, 'B%d' % baud)
+            termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+    def write(self, data):
+        data = bytes(data)
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def readline(self, timeout):
+        """ Returns the next line without line end, None if none arrived within timeout seconds. """
+        end = time.time() + timeout
+        while b'\n' not in self.received:
+            left = end - time.time()
+            if left <= 0 or not select.select([self.fd], [], [], left)[0]:
+                return None
+            self.received += bytearray(os.read(self.fd, 256))
+        line, _, rest = bytes(self.received).partition(b'\n')
+        self.received = bytearray(rest)
+        return line.decode('ascii', 'replace').strip()
+
+
+class Sender(object):
+    """ Streams lines as frames, with up to window frames and buffer bytes waiting for their ok. On
+    "Resend: <sequence number>" it goes back to that frame, if nothing arrives for timeout seconds it sends the
+    unacknowledged frames again. """
+
+    def __init__(self, port, window=4, buffer=127, timeout=2.0, echo=print):
+        if not 0 < window < 128:
+            raise ValueError('the window must be 1 to 127 frames')
+        self.port = port
+        self.window = window
+        self.buffer = buffer
+        self.timeout = timeout
+        self.echo = echo
+        self.resends = 0
+        self.timeouts = 0
+        self.bytes_sent = 0
+
+    def command(self, line):
+        """ Sends a text line and waits for its ok. """
+        self.port.write((line + '\n').encode('ascii'))
+        while True:
+            reply = self.port.readline(self.timeout)
+            if reply is None:
+                raise IOError('no ok for ' + line)
+            if reply.startswith('ok'):
+                return
+            self.echo(reply)
+
+    def send(self, lines):
+        encoder = Encoder()
+        frames = []
+        for line in lines:
+            if not strip_line(line):
+                continue
+            if re.match(r'M0*28\b', strip_line(line).upper()):
+                raise ValueError('writing to the SD card needs text mode: ' + line)
+            kind, payload = encoder.encode(line)
+            frames.append(make_frame(len(frames), kind, payload))
+        frames.append(make_frame(len(frames), TEXT, bytearray(b'M530 S0')))
+
+        self.command('M530 S1')
+        acked = 0
+        sent = 0
+        while acked < len(frames):
+            while (sent < len(frames) and sent - acked < self.window and
+                   (sent == acked or sum(len(f) for f in frames[acked:sent + 1]) <= self.buffer)):
+                self.port.write(frames[sent])
+                self.bytes_sent += len(frames[sent])
+                sent += 1
+            reply = self.port.readline(self.timeout)
+            if reply is None:
+                self.timeouts += 1
+                sent = acked
+            elif reply.startswith('ok'):
+                acked += 1
+            elif reply.startswith('Resend:'):
+                asked = acked + ((int(reply.split(':')[1]) - acked) & 0xff)
+                if asked <= sent:
+                    self.resends += 1
+                    sent = asked
+            elif not reply.startswith('Error:checksum mismatch'):
+                self.echo(reply)
+        return len(frames)
+
+
+class Printer(threading.Thread):
+    """ The firmware side for --loopback: text lines until M530 S1, then frames checked, acknowledged and asked
+    for again like get_binary_frames() does. Moves are acknowledged when they are queued, other commands after a
+    few more bytes have been read, as if they took time to run. A fraction of the received bytes is damaged or
+    lost on the way. """
+
+    def __init__(self, fd, error_rate, seed):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.port = Port(fd)
+        self.error_rate = error_rate
+        self.random = random.Random(seed)
+        self.decoder = Decoder()
+        self.binary = False
+        self.line = bytearray()
+        self.expected = 0
+        self.resend_sent = False
+        self.queue = []
+        self.commands = []
+        self.damaged = 0
+        self.stop = False
+
+    def reply(self, text):
+        self.port.write((text + '\n').encode('ascii'))
+
+    def execute(self, code, params, move=False):
+        self.commands.append((code, params))
+        if move:
+            return
+        if code == 'M530':
+            self.binary = params.get('S', 0) != 0
+            self.expected = 0
+            self.resend_sent = False
+            self.decoder.reset()
+        self.reply('ok')
+
+    def received(self, byte):
+        if not self.binary:
+            if byte == ord('\n'):
+                code, params = parse_words(self.line.decode('ascii'))
+                self.line = bytearray()
+                self.execute(code, params)
+            else:
+                self.line.append(byte)
+            return
+        for frame in self.decoder.feed(bytearray([byte])):
+            if frame is None:
+                self.reply('Error:checksum mismatch, Last Line: %d' % ((self.expected - 1) & 0xff))
+                if not self.resend_sent or self.decoder.broken[2] == self.expected:
+                    self.resend()
+                continue
+            seq, kind, payload = frame
+            if seq != self.expected:
+                if (self.expected - seq) & 0xff > 128 and not self.resend_sent:
+                    self.resend()
+                continue
+            self.resend_sent = False
+            self.expected = (self.expected + 1) & 0xff
+            if kind == MOVE and Decoder.move_length(payload) == len(payload):
+                code, params = self.decoder.decode_move(payload)
+                self.queue.append([0, code, params, True])
+                self.reply('ok')
+            elif kind == TEXT:
+                code, params = parse_words(payload.decode('ascii'))
+                self.queue.append([self.random.randint(0, 40), code, params, False])
+            else:
+                self.reply('Error:Unknown frame')
+                self.reply('ok')
+
+    def resend(self):
+        self.resend_sent = True
+        self.reply('Resend: %d' % self.expected)
+
+    def run(self):
+        while not self.stop:
+            if not select.select([self.port.fd], [], [], 0.05)[0]:
+                data = bytearray()
+            else:
+                data = bytearray(os.read(self.port.fd, 256))
+            for byte in data:
+                if self.binary and self.random.random() < self.error_rate:
+                    self.damaged += 1
+                    if self.random.random() < 0.5:
+                        continue
+                    byte ^= 1 << self.random.randint(0, 7)
+                self.received(byte)
+                self.tick()
+            if not data:
+                while self.queue:
+                    self.tick(force=True)
+
+    def tick(self, force=False):
+        """ Runs the commands in the order they were queued, each after its delay. """
+        while self.queue and (self.queue[0][0] == 0 or force):
+            delay, code, params, move = self.queue.pop(0)
+            self.execute(code, params, move)
+        if self.queue:
+            self.queue[0][0] -= 1
+
+
+def test_program(count, seed):
+    """ Random moves with a few other commands in between, like sliced g-code. """
+    rnd = random.Random(seed)
+    lines = ['G28', 'M104 S200', 'G92 E0', 'G1 F1800']
+    x, y, e = 100.0, 100.0, 0.0
+    for n in range(count):
+        choice = rnd.random()
+        if choice < 0.02:
+            lines.append('M106 S%d' % rnd.randint(0, 255))
+        elif choice < 0.04:
+            lines.append('G1 Z%.2f F600 ; layer change' % rnd.uniform(0.2, 100))
+        elif choice < 0.06:
+            lines.append('G0 X%.3f Y%.3f F9000' % (rnd.uniform(0, 200), rnd.uniform(0, 200)))
+        elif choice < 0.07:
+            lines.append('G1 X%.6f Y%.6f' % (rnd.uniform(0, 200), rnd.uniform(0, 200)))
+        else:
+            x = min(200.0, max(0.0, x + rnd.uniform(-5, 5)))
+            y = min(200.0, max(0.0, y + rnd.uniform(-5, 5)))
+            e += rnd.uniform(0, 0.3)
+            lines.append('G1 X%.3f Y%.3f E%.5f' % (x, y, e))
+    lines.append('M104 S0')
+    return lines
+
+
+def ascii_bytes(lines):
+    """ Bytes the lines take with line numbers and checksums. """
+    total = 0
+    for n, line in enumerate(l for l in map(strip_line, lines) if l):
+        line = 'N%d %s' % (n + 1, line)
+        checksum = 0
+        for c in line:
+            checksum ^= ord(c)
+        total += len('%s*%d\n' % (line, checksum))
+    return total
+
+
+def loopback(args):
+    lines = open(args.file).readlines() if args.file else test_program(args.moves, args.seed)
+    master, slave = os.openpty()
+    printer = Printer(master, args.error_rate, args.seed)
+    printer.start()
+    sender = Sender(Port(slave), args.window, args.buffer, args.timeout, echo=lambda line: None)
+    started = time.time()
+    frames = sender.send(lines)
+    printer.stop = True
+    printer.join()
+
+    expected = [('M530', {'S': 1.0})]
+    for line in lines:
+        if strip_line(line):
+            expected.append(parse_words(strip_line(line)))
+    expected.append(('M530', {'S': 0.0}))
+    got = printer.commands
+    errors = 0
+    for n in range(max(len(expected), len(got))):
+        want = expected[n] if n < len(expected) else None
+        have = got[n] if n < len(got) else None
+        if (want is None or have is None or want[0] != have[0] or sorted(want[1]) != sorted(have[1]) or
+                any(abs(want[1][k] - have[1][k]) > 1e-9 + 0.5 / SCALES[FIELDS.find(k)] if k in FIELDS else
+                    want[1][k] != have[1][k] for k in want[1])):
+            errors += 1
+            if errors <= 10:
+                print('command %d: expected %r, got %r' % (n, want, have))
+    print('%d lines in %d frames, %d bytes instead of %d as text lines, %.1f s' %
+          (len(expected) - 2, frames, sender.bytes_sent, ascii_bytes(lines), time.time() - started))
+    print('%d bytes damaged, %d resends, %d timeouts, %d commands wrong' %
+          (printer.damaged, sender.resends, sender.timeouts, errors))
+    return 1 if errors else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('file', nargs='?', help='g-code file to send (default: a generated test print with --loopback)')
+    parser.add_argument('-p', '--port', help='serial port of the printer, e.g. /dev/ttyUSB0')
+    parser.add_argument('-b', '--baud', type=int, default=115200, help='baud rate (default=115200)')
+    parser.add_argument('-w', '--window', type=int, default=4, help='frames sent ahead of their ok (default=4)')
+    parser.add_argument('--buffer', type=int, default=127,
+                        help='bytes sent ahead of their ok, the receive buffer of the firmware (default=127)')
+    parser.add_argument('-t', '--timeout', type=float, default=2.0,
+                        help='seconds without reply before the unacknowledged frames are sent again (default=2)')
+    parser.add_argument('--loopback', action='store_true',
+                        help='send to a simulated printer over a pseudo terminal and check what it received')
+    parser.add_argument('--error-rate', type=float, default=0.002,
+                        help='part of the bytes damaged or lost on the way with --loopback (default=0.002)')
+    parser.add_argument('--moves', type=int, default=5000, help='lines of the generated test print (default=5000)')
+    parser.add_argument('--seed', type=int, default=1, help='random seed of --loopback (default=1)')
+    args = parser.parse_args()
+
+    if args.loopback:
+        return loopback(args)
+    if not args.port or not args.file:
+        parser.error('a g-code file and --port are needed unless --loopback is given')
+    port = Port(os.open(args.port, os.O_RDWR | os.O_NOCTTY), args.baud)
+    sender = Sender(port, args.window, args.buffer, args.timeout)
+    frames = sender.send(open(args.file).readlines())
+    print('%d frames, %d bytes, %d resends, %d timeouts' % (frames, sender.bytes_sent, sender.resends, sender.timeouts))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -145,3 +145,113 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   //   plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
 }
 
+
+#ifdef SEGMENT_COALESCING
+
+static float coalesce_start[NUM_AXIS];      // Start of the held back move, the end of the last move sent to the planner
+static float coalesce_end[NUM_AXIS];        // End of the held back move
+static float coalesce_corner[SEGMENT_COALESCE_MAX_SEGMENTS-1][3]; // Dropped corners inside the held back move
+static float coalesce_unit_vec[3];          // Direction of the last segment merged into the held back move
+static float coalesce_e_per_mm;             // Extrusion per mm of the first segment of the held back move
+static float coalesce_feed_rate;
+static uint8_t coalesce_extruder;
+static uint8_t coalesce_segments = 0;       // Number of segments in the held back move, 0 if there is none
+static bool coalesce_start_known = false;   // coalesce_start is only valid after a move was queued
+
+// cos(SEGMENT_COALESCE_MAX_ANGLE), folded to a constant by the compiler
+#define SEGMENT_COALESCE_MIN_COS cos(SEGMENT_COALESCE_MAX_ANGLE*M_PI/180.0)
+
+static void coalesce_send()
+{
+  plan_buffer_line(coalesce_end[X_AXIS], coalesce_end[Y_AXIS], coalesce_end[Z_AXIS], coalesce_end[E_AXIS], coalesce_feed_rate, coalesce_extruder);
+  memcpy(coalesce_start, coalesce_end, sizeof(coalesce_start));
+  coalesce_segments = 0;
+}
+
+// Checks whether the held back move can be extended to target without any of its corners, including
+// its current end, leaving the straight line from coalesce_start to target by more than the tolerance.
+static bool coalesce_fits(const float *target)
+{
+  float chord[3];
+  float chord_sqr = 0;
+  for(int8_t i=0; i < 3; i++) {
+    chord[i] = target[i] - coalesce_start[i];
+    chord_sqr += square(chord[i]);
+  }
+  if (chord_sqr > square(SEGMENT_COALESCE_MAX_LENGTH)) return false;
+
+  // distance^2 * |chord|^2 = |corner x chord|^2, compared without a sqrt or a divide
+  const float max_cross_sqr = square(SEGMENT_COALESCE_TOLERANCE)*chord_sqr;
+  for(uint8_t n=0; n < coalesce_segments; n++) {
+    const float *corner = (n < coalesce_segments-1) ? coalesce_corner[n] : coalesce_end;
+    float dx = corner[X_AXIS] - coalesce_start[X_AXIS];
+    float dy = corner[Y_AXIS] - coalesce_start[Y_AXIS];
+    float dz = corner[Z_AXIS] - coalesce_start[Z_AXIS];
+    float cross_sqr = square(dy*chord[Z_AXIS] - dz*chord[Y_AXIS]) + square(dz*chord[X_AXIS] - dx*chord[Z_AXIS]) + square(dx*chord[Y_AXIS] - dy*chord[X_AXIS]);
+    if (cross_sqr > max_cross_sqr) return false;
+  }
+  return true;
+}
+
+void mc_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  const float target[NUM_AXIS] = { x, y, z, e };
+  const float *from = coalesce_segments ? coalesce_end : coalesce_start;
+  float delta[3];
+  for(int8_t i=0; i < 3; i++) {
+    delta[i] = target[i] - from[i];
+  }
+  float length = sqrt(square(delta[X_AXIS]) + square(delta[Y_AXIS]) + square(delta[Z_AXIS]));
+
+  // Long moves, extruder only moves and the first move after a flush go straight to the planner
+  if (!coalesce_start_known || length < 0.001 || length >= SEGMENT_COALESCE_MAX_LENGTH) {
+    if (coalesce_segments) coalesce_send();
+    plan_buffer_line(x, y, z, e, feed_rate, extruder);
+    memcpy(coalesce_start, target, sizeof(coalesce_start));
+    coalesce_start_known = true;
+    return;
+  }
+
+  float inverse_length = 1.0/length;
+  float unit_vec[3];
+  for(int8_t i=0; i < 3; i++) {
+    unit_vec[i] = delta[i]*inverse_length;
+  }
+  float e_per_mm = (target[E_AXIS] - from[E_AXIS])*inverse_length;
+
+  if (coalesce_segments) {
+    if (feed_rate == coalesce_feed_rate && extruder == coalesce_extruder &&
+        unit_vec[X_AXIS]*coalesce_unit_vec[X_AXIS] + unit_vec[Y_AXIS]*coalesce_unit_vec[Y_AXIS] + unit_vec[Z_AXIS]*coalesce_unit_vec[Z_AXIS] >= SEGMENT_COALESCE_MIN_COS &&
+        fabs(e_per_mm - coalesce_e_per_mm) <= SEGMENT_COALESCE_E_RATIO*fabs(coalesce_e_per_mm) &&
+        coalesce_fits(target)) {
+      memcpy(coalesce_corner[coalesce_segments-1], coalesce_end, sizeof(coalesce_corner[0]));
+      memcpy(coalesce_end, target, sizeof(coalesce_end));
+      memcpy(coalesce_unit_vec, unit_vec, sizeof(coalesce_unit_vec));
+      if (++coalesce_segments == SEGMENT_COALESCE_MAX_SEGMENTS) coalesce_send();
+      return;
+    }
+    coalesce_send();
+  }
+
+  // Start a new held back move
+  memcpy(coalesce_end, target, sizeof(coalesce_end));
+  memcpy(coalesce_unit_vec, unit_vec, sizeof(coalesce_unit_vec));
+  coalesce_e_per_mm = e_per_mm;
+  coalesce_feed_rate = feed_rate;
+  coalesce_extruder = extruder;
+  coalesce_segments = 1;
+}
+
+void mc_flush_line()
+{
+  if (coalesce_segments) coalesce_send();
+  coalesce_start_known = false;
+}
+
+void mc_discard_line()
+{
+  coalesce_segments = 0;
+  coalesce_start_known = false;
+}
+
+#endif //SEGMENT_COALESCING
@@ -22,11 +22,33 @@
 #ifndef motion_control_h
 #define motion_control_h
 
+#include "planner.h"
+
 // Execute an arc in offset mode format. position == current xyz, target == target xyz, 
 // offset == offset from current xyz, axis_XXX defines circle plane in tool space, axis_linear is
 // the direction of helical travel, radius == circle radius, isclockwise boolean. Used
 // for vector transformation direction.
 void mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
   unsigned char axis_linear, float feed_rate, float radius, unsigned char isclockwise, uint8_t extruder);
+
+#ifdef SEGMENT_COALESCING
+// Queue a G0/G1 move. Short moves that continue the previous one in (almost) the same direction
+// are held back and merged into a single planner block.
+void mc_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
+
+// Send the held back move to the planner. Must be called before anything else is done with the
+// planner or the position, the next mc_line() starts a new move.
+void mc_flush_line();
+
+// Forget the held back move without executing it. Used when the printer is stopped.
+void mc_discard_line();
+#else
+FORCE_INLINE void mc_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  plan_buffer_line(x, y, z, e, feed_rate, extruder);
+}
+FORCE_INLINE void mc_flush_line() {}
+FORCE_INLINE void mc_discard_line() {}
+#endif
   
 #endif
@@ -0,0 +1,44 @@
+#include "parse_number.h"
+
+// Reads a decimal number like strtod() but without exponents, infinities or hex. The digits are gathered in a
+// long and only converted to float once, which is much faster than the double math of avr-libc. Digits beyond
+// the 9th are dropped, g-code parameters have far less than that.
+float parse_float(const char *str)
+{
+  while(*str == ' ' || *str == '\t') str++;
+  bool negative = (*str == '-');
+  if(negative || *str == '+') str++;
+  unsigned long mantissa = 0;
+  signed char exponent = 0;
+  for(; *str >= '0' && *str <= '9'; str++) {
+    if(mantissa < 100000000UL) mantissa = mantissa * 10 + (*str - '0');
+    else exponent++;
+  }
+  if(*str == '.') {
+    for(str++; *str >= '0' && *str <= '9'; str++) {
+      if(mantissa < 100000000UL) {
+        mantissa = mantissa * 10 + (*str - '0');
+        exponent--;
+      }
+    }
+  }
+  float value = mantissa;
+  if(exponent != 0) {
+    float scale = 1;
+    for(signed char i = exponent < 0 ? -exponent : exponent; i > 0; i--) scale *= 10;
+    if(exponent < 0) value /= scale;
+    else value *= scale;
+  }
+  return negative ? -value : value;
+}
+
+// Reads a decimal integer like strtol(str, NULL, 10)
+long parse_long(const char *str)
+{
+  while(*str == ' ' || *str == '\t') str++;
+  bool negative = (*str == '-');
+  if(negative || *str == '+') str++;
+  unsigned long value = 0;
+  for(; *str >= '0' && *str <= '9'; str++) value = value * 10 + (*str - '0');
+  return negative ? -(long)value : (long)value;
+}
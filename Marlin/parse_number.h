@@ -0,0 +1,11 @@
+#ifndef __PARSE_NUMBERH
+
+#define __PARSE_NUMBERH
+#include "Marlin.h"
+
+// Read the number at the start of a g-code parameter, like strtod() and strtol(str, NULL, 10) but without
+// exponents, infinities or hex, see parse_number.cpp
+float parse_float(const char *str);
+long parse_long(const char *str);
+
+#endif
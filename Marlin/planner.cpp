@@ -69,10 +69,13 @@ float axis_steps_per_unit[4];
 unsigned long max_acceleration_units_per_sq_second[4]; // Use M201 to override by software
 float minimumfeedrate;
 float acceleration;         // Normal acceleration mm/s^2  THIS IS THE DEFAULT ACCELERATION for all moves. M204 SXXXX
-float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 TXXXX
+float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 RXXXX
+float travel_acceleration;  //  mm/s^2   moves without extrusion M204 TXXXX
 float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 float max_z_jerk;
 float max_e_jerk;
+unsigned char cornering_mode;
+float junction_deviation;
 float mintravelfeedrate;
 unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 
@@ -80,6 +83,7 @@ unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 long position[4];   //rescaled from extern when axis_steps_per_unit are changed by gcode
 static float previous_speed[4]; // Speed of previous path line segment
 static float previous_nominal_speed; // Nominal speed of previous path line segment
+static float previous_unit_vec[3]; // Unit vector of previous path line segment, zero if it had no XYZ motion
 
 extern volatile int extrudemultiply; // Sets extrude multiply factor (in percent)
 
@@ -96,6 +100,10 @@ extern volatile int extrudemultiply; // Sets extrude multiply factor (in percent
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
+static unsigned char block_buffer_planned;          // Index of the newest block whose entry speed can no longer change
+volatile unsigned long block_buffer_runtime_us;     // Sum of segment_time_us of the blocks in the buffer
+volatile unsigned char block_buffer_axis_count[NUM_AXIS]; // Number of blocks in the buffer that move each axis
+volatile unsigned char block_buffer_fan_count;      // Number of blocks in the buffer with the fan on
 
 //===========================================================================
 //=============================private variables ============================
@@ -103,6 +111,14 @@ volatile unsigned char block_buffer_tail;           // Index of the block to pro
 #ifdef PREVENT_DANGEROUS_EXTRUDE
   bool allow_cold_extrude=false;
 #endif
+#ifdef AUTOTEMP
+  // E speeds of the buffered blocks that are faster than every block queued after them, oldest first.
+  // The first entry is the highest E speed in the buffer.
+  static unsigned char e_speed_block[BLOCK_BUFFER_SIZE]; // Index of the block in block_buffer
+  static float e_speed[BLOCK_BUFFER_SIZE];
+  static unsigned char e_speed_head;
+  static unsigned char e_speed_tail;
+#endif
 #ifdef XY_FREQUENCY_LIMIT
   // Used for the frequency limit
   static unsigned char old_direction_bits = 0;               // Old direction bits. Used for speed calculations
@@ -130,6 +146,14 @@ static int8_t prev_block_index(int8_t block_index) {
 //=============================functions         ============================
 //===========================================================================
 
+// The stepper interrupt subtracts from block_buffer_runtime_us, so read it atomically
+static unsigned long block_buffer_runtime() {
+  CRITICAL_SECTION_START;
+  unsigned long runtime = block_buffer_runtime_us;
+  CRITICAL_SECTION_END;
+  return runtime;
+}
+
 // Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate using the 
 // given acceleration:
 FORCE_INLINE float estimate_acceleration_distance(float initial_rate, float target_rate, float acceleration)
@@ -159,21 +183,68 @@ FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, f
   }
 }
 
+#ifdef FIXED_POINT_TRAPEZOID
+// Integer versions of the above in steps. Rates never exceed MAX_STEP_FREQUENCY, so their squares fit in an
+// unsigned long. double_acceleration is 2*acceleration in steps/sec^2 and must not be 0.
+
+// Steps to accelerate from initial_rate to target_rate, rounded up.
+FORCE_INLINE long acceleration_steps(unsigned long initial_rate, unsigned long target_rate, unsigned long double_acceleration)
+{
+  if (target_rate <= initial_rate) return 0;
+  return (target_rate*target_rate - initial_rate*initial_rate + double_acceleration - 1) / double_acceleration;
+}
+
+// Steps to decelerate from initial_rate to target_rate, rounded down.
+FORCE_INLINE long deceleration_steps(unsigned long initial_rate, unsigned long target_rate, unsigned long double_acceleration)
+{
+  if (target_rate >= initial_rate) return 0;
+  return (initial_rate*initial_rate - target_rate*target_rate) / double_acceleration;
+}
+
+// intersection_distance() rounded up. (2 a d - s1^2 + s2^2)/(4 a) is split into d/2 + (s2^2 - s1^2)/(4 a)
+// so that nothing overflows 32 bits.
+FORCE_INLINE long intersection_steps(unsigned long initial_rate, unsigned long final_rate, unsigned long double_acceleration, unsigned long distance)
+{
+  unsigned long quad_acceleration = double_acceleration << 1;
+  long steps = distance >> 1;
+  unsigned long odd = (distance & 1) ? double_acceleration : 0; // The half step of an odd distance, times 4 a
+  if (final_rate >= initial_rate) {
+    return steps + (odd + final_rate*final_rate - initial_rate*initial_rate + quad_acceleration - 1) / quad_acceleration;
+  }
+  unsigned long difference = initial_rate*initial_rate - final_rate*final_rate;
+  if (difference <= odd) {
+    return steps + (difference < odd ? 1 : 0);
+  }
+  return steps - (difference - odd) / quad_acceleration;
+}
+#endif // FIXED_POINT_TRAPEZOID
+
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
+// nominal_rate is stored together with them, so the stepper never sees a nominal rate without its trapezoid.
 
-void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
-  unsigned long initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
-  unsigned long final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
+void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor, unsigned short nominal_rate) {
+  unsigned long initial_rate = ceil(nominal_rate*entry_factor); // (step/min)
+  unsigned long final_rate = ceil(nominal_rate*exit_factor); // (step/min)
 
   // Limit minimal step rate (Otherwise the timer will overflow.)
   if(initial_rate <120) {initial_rate=120; }
   if(final_rate < 120) {final_rate=120;  }
   
+  #ifdef FIXED_POINT_TRAPEZOID
+  unsigned long double_acceleration = block->acceleration_st << 1;
+  int32_t accelerate_steps = 0;
+  int32_t decelerate_steps = 0;
+  if (double_acceleration != 0) {
+    accelerate_steps = acceleration_steps(initial_rate, nominal_rate, double_acceleration);
+    decelerate_steps = deceleration_steps(nominal_rate, final_rate, double_acceleration);
+  }
+  #else
   long acceleration = block->acceleration_st;
   int32_t accelerate_steps =
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration));
+    ceil(estimate_acceleration_distance(initial_rate, nominal_rate, acceleration));
   int32_t decelerate_steps =
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration));
+    floor(estimate_acceleration_distance(nominal_rate, final_rate, -acceleration));
+  #endif
     
   // Calculate the size of Plateau of Nominal Rate.
   int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
@@ -182,13 +253,37 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   // have to use intersection_distance() to calculate when to abort acceleration and start braking
   // in order to reach the final_rate exactly at the end of this block.
   if (plateau_steps < 0) {
+    #ifdef FIXED_POINT_TRAPEZOID
+    if (double_acceleration != 0) {
+      accelerate_steps = intersection_steps(initial_rate, final_rate, double_acceleration, block->step_event_count);
+    }
+    #else
     accelerate_steps = ceil(
-      intersection_distance(block->initial_rate, block->final_rate, acceleration, block->step_event_count));
+      intersection_distance(initial_rate, final_rate, acceleration, block->step_event_count));
+    #endif
     accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
     accelerate_steps = min(accelerate_steps,block->step_event_count);
     plateau_steps = 0;
   }
 
+  #ifdef S_CURVE_ACCELERATION
+    // The S-curve in the stepper interrupt needs the peak rate and the duration of the ramps, in timer ticks.
+    // Without a plateau the peak is where acceleration and deceleration meet.
+    unsigned long cruise_rate = nominal_rate;
+    if(plateau_steps == 0 && block->acceleration_st != 0) {
+      cruise_rate = min(cruise_rate, sqrt(square((float)initial_rate) + 2.0*block->acceleration_st*accelerate_steps));
+    }
+    if(cruise_rate < initial_rate) cruise_rate = initial_rate; // Only possible for blocks below the 120 steps/s minimum
+    unsigned long acceleration_ticks = 0;
+    unsigned long deceleration_ticks = 0;
+    if(block->acceleration_st != 0) {
+      if(cruise_rate > initial_rate) acceleration_ticks = (cruise_rate - initial_rate)*(F_CPU/8.0)/block->acceleration_st;
+      if(cruise_rate > final_rate) deceleration_ticks = (cruise_rate - final_rate)*(F_CPU/8.0)/block->acceleration_st;
+    }
+    unsigned long acceleration_inverse = (acceleration_ticks != 0) ? 0xffffffff/acceleration_ticks : 0;
+    unsigned long deceleration_inverse = (deceleration_ticks != 0) ? 0xffffffff/deceleration_ticks : 0;
+  #endif // S_CURVE_ACCELERATION
+
   #ifdef ADVANCE
     volatile long initial_advance = block->advance*entry_factor*entry_factor; 
     volatile long final_advance = block->advance*exit_factor*exit_factor;
@@ -198,10 +293,18 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
  // block->decelerate_after = accelerate_steps+plateau_steps;
   CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
   if(block->busy == false) { // Don't update variables if block is busy.
+    block->nominal_rate = nominal_rate;
     block->accelerate_until = accelerate_steps;
     block->decelerate_after = accelerate_steps+plateau_steps;
     block->initial_rate = initial_rate;
     block->final_rate = final_rate;
+  #ifdef S_CURVE_ACCELERATION
+    block->cruise_rate = cruise_rate;
+    block->acceleration_ticks = acceleration_ticks;
+    block->acceleration_inverse = acceleration_inverse;
+    block->deceleration_ticks = deceleration_ticks;
+    block->deceleration_inverse = deceleration_inverse;
+  #endif
   #ifdef ADVANCE
       block->initial_advance = initial_advance;
       block->final_advance = final_advance;
@@ -210,10 +313,18 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   CRITICAL_SECTION_END;
 }                    
 
+// Lowers the acceleration (steps/sec^2 of the axis with the most steps) so that an axis making steps of the
+// step_event_count steps of a block stays within its own limit axis_acceleration.
+FORCE_INLINE void limit_axis_acceleration(unsigned long &acceleration_st, long steps, unsigned long step_event_count, unsigned long axis_acceleration)
+{
+  if((float)acceleration_st * steps > (float)axis_acceleration * step_event_count)
+    acceleration_st = (float)axis_acceleration * step_event_count / steps;
+}
+
 // Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the 
-// acceleration within the allotted distance.
-FORCE_INLINE float max_allowable_speed(float acceleration, float target_velocity, float distance) {
-  return  sqrt(target_velocity*target_velocity-2*acceleration*distance);
+// acceleration within the allotted distance. delta_speed_sqr is 2*acceleration*distance.
+FORCE_INLINE float max_allowable_speed(float delta_speed_sqr, float target_velocity) {
+  return  sqrt(target_velocity*target_velocity+delta_speed_sqr);
 }
 
 // "Junction jerk" in this context is the immediate change in speed at the junction of two blocks.
@@ -237,26 +348,26 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
     
       // If nominal length true, max junction speed is guaranteed to be reached. Only compute
       // for max allowable speed if block is decelerating and nominal length is false.
-      if ((!current->nominal_length_flag) && (current->max_entry_speed > next->entry_speed)) {
+      if ((!(current->flag & BLOCK_FLAG_NOMINAL_LENGTH)) && (current->max_entry_speed > next->entry_speed)) {
         current->entry_speed = min( current->max_entry_speed,
-          max_allowable_speed(-current->acceleration,next->entry_speed,current->millimeters));
+          max_allowable_speed(current->delta_speed_sqr,next->entry_speed));
       } else {
         current->entry_speed = current->max_entry_speed;
       }
-      current->recalculate_flag = true;
+      current->flag |= BLOCK_FLAG_RECALCULATE;
     
     }
   } // Skip last block. Already initialized and set for recalculation.
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
+// implements the reverse pass. It stops at block_buffer_planned, as nothing before it can change any more.
 void planner_reverse_pass() {
   uint8_t block_index = block_buffer_head;
-  if(((block_buffer_head-block_buffer_tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
+  if(((block_buffer_head-block_buffer_planned + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
     block_index = (block_buffer_head - 3) & (BLOCK_BUFFER_SIZE - 1);
     block_t *block[3] = { NULL, NULL, NULL };
-    while(block_index != block_buffer_tail) { 
+    while(block_index != block_buffer_planned) { 
       block_index = prev_block_index(block_index); 
       block[2]= block[1];
       block[1]= block[0];
@@ -267,70 +378,79 @@ void planner_reverse_pass() {
 }
 
 // The kernel called by planner_recalculate() when scanning the plan from first to last entry.
-void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
-  if(!previous) { return; }
+// Returns true if the entry speed of current is final: either it is at its maximum, or the previous
+// block accelerates over its whole length to reach it.
+bool planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
+  if(!previous) { return false; }
   
   // If the previous block is an acceleration block, but it is not long enough to complete the
   // full speed change within the block, we need to adjust the entry speed accordingly. Entry
   // speeds have already been reset, maximized, and reverse planned by reverse planner.
   // If nominal length is true, max junction speed is guaranteed to be reached. No need to recheck.
-  if (!previous->nominal_length_flag) {
+  if (!(previous->flag & BLOCK_FLAG_NOMINAL_LENGTH)) {
     if (previous->entry_speed < current->entry_speed) {
       double entry_speed = min( current->entry_speed,
-        max_allowable_speed(-previous->acceleration,previous->entry_speed,previous->millimeters) );
+        max_allowable_speed(previous->delta_speed_sqr,previous->entry_speed) );
 
       // Check for junction speed change
       if (current->entry_speed != entry_speed) {
         current->entry_speed = entry_speed;
-        current->recalculate_flag = true;
+        current->flag |= BLOCK_FLAG_RECALCULATE;
+        return true;
       }
     }
   }
+  return (current->entry_speed == current->max_entry_speed);
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the forward pass.
+// implements the forward pass, starting at block_buffer_planned and moving it up to the newest block whose
+// entry speed is final. The reverse pass never sets the entry speed of the 4 newest blocks, so they can't be final.
 void planner_forward_pass() {
-  uint8_t block_index = block_buffer_tail;
+  uint8_t block_index = block_buffer_planned;
+  uint8_t current_index = block_index;
   block_t *block[3] = { NULL, NULL, NULL };
 
   while(block_index != block_buffer_head) {
     block[0] = block[1];
     block[1] = block[2];
     block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
+    if(planner_forward_pass_kernel(block[0],block[1],block[2]) &&
+       (((block_buffer_head - current_index) & (BLOCK_BUFFER_SIZE - 1)) > 4)) {
+      block_buffer_planned = current_index;
+    }
+    current_index = block_index;
     block_index = next_block_index(block_index);
   }
   planner_forward_pass_kernel(block[1], block[2], NULL);
 }
 
 // Recalculates the trapezoid speed profiles for all blocks in the plan according to the 
-// entry_factor for each junction. Must be called by planner_recalculate() after 
+// entry_factor for each junction, starting at block_index. Must be called by planner_recalculate() after 
 // updating the blocks.
-void planner_recalculate_trapezoids() {
-  int8_t block_index = block_buffer_tail;
+void planner_recalculate_trapezoids(int8_t block_index) {
   block_t *current;
   block_t *next = NULL;
   
   while(block_index != block_buffer_head) {
     current = next;
     next = &block_buffer[block_index];
-    if (current) {
+    if (current && current->step_event_count != 0) { // Dwells have no trapezoid
       // Recalculate if current block entry or exit junction speed has changed.
-      if (current->recalculate_flag || next->recalculate_flag) {
+      if ((current->flag | next->flag) & BLOCK_FLAG_RECALCULATE) {
         // NOTE: Entry and exit factors always > 0 by all previous logic operations.
         calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
-          next->entry_speed/current->nominal_speed);
-        current->recalculate_flag = false; // Reset current only to ensure next trapezoid is computed
+          next->entry_speed/current->nominal_speed, current->nominal_rate);
+        current->flag &= ~BLOCK_FLAG_RECALCULATE; // Reset current only to ensure next trapezoid is computed
       }
     }
     block_index = next_block_index( block_index );
   }
   // Last/newest block in buffer. Exit speed is set with MINIMUM_PLANNER_SPEED. Always recalculated.
-  if(next != NULL) {
+  if(next != NULL && next->step_event_count != 0) {
     calculate_trapezoid_for_block(next, next->entry_speed/next->nominal_speed,
-      MINIMUM_PLANNER_SPEED/next->nominal_speed);
-    next->recalculate_flag = false;
+      MINIMUM_PLANNER_SPEED/next->nominal_speed, next->nominal_rate);
+    next->flag &= ~BLOCK_FLAG_RECALCULATE;
   }
 }
 
@@ -351,15 +471,34 @@ void planner_recalculate_trapezoids() {
 //
 //   3. Recalculate trapezoids for all blocks.
 
+//
+// Only the blocks after block_buffer_planned are visited, which keeps the cost of adding a block roughly
+// constant instead of growing with BLOCK_BUFFER_SIZE.
+
 void planner_recalculate() {   
+  // The stepper interrupt may have taken the planned block since the last call, continue from the tail then.
+  unsigned char tail = block_buffer_tail;
+  if(((block_buffer_planned - tail) & (BLOCK_BUFFER_SIZE - 1)) > ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1))) {
+    block_buffer_planned = tail;
+  }
+  // The blocks between the old and the new planned pointer need their trapezoids recalculated too.
+  unsigned char first_block = block_buffer_planned;
   planner_reverse_pass();
   planner_forward_pass();
-  planner_recalculate_trapezoids();
+  planner_recalculate_trapezoids(first_block);
 }
 
 void plan_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  block_buffer_planned = 0;
+  block_buffer_runtime_us = 0;
+  memset((void *)block_buffer_axis_count, 0, sizeof(block_buffer_axis_count));
+  block_buffer_fan_count = 0;
+  #ifdef AUTOTEMP
+    e_speed_head = 0;
+    e_speed_tail = 0;
+  #endif
   memset(position, 0, sizeof(position)); // clear position
   previous_speed[0] = 0.0;
   previous_speed[1] = 0.0;
@@ -372,6 +511,32 @@ void plan_init() {
 
 
 #ifdef AUTOTEMP
+// Drops the entries of blocks that have been executed from the front of the E speed queue.
+// Blocks leave the buffer in the order they were queued, so these are always at the front.
+static void e_speed_drop_discarded()
+{
+  uint8_t tail = block_buffer_tail;
+  uint8_t queued = (block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1);
+  while((e_speed_tail != e_speed_head) && (((e_speed_block[e_speed_tail] - tail) & (BLOCK_BUFFER_SIZE - 1)) >= queued)) {
+    e_speed_tail = (e_speed_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
+  }
+}
+
+// Adds a block to the back of the E speed queue, after removing the entries it is at least as fast as.
+// They can never be the maximum again because they leave the buffer before this block.
+static void e_speed_push(uint8_t block_index, float se)
+{
+  e_speed_drop_discarded();
+  while(e_speed_head != e_speed_tail) {
+    uint8_t last = (e_speed_head - 1) & (BLOCK_BUFFER_SIZE - 1);
+    if(e_speed[last] > se) break;
+    e_speed_head = last;
+  }
+  e_speed_block[e_speed_head] = block_index;
+  e_speed[e_speed_head] = se;
+  e_speed_head = (e_speed_head + 1) & (BLOCK_BUFFER_SIZE - 1);
+}
+
 void getHighESpeed()
 {
   static float oldt=0;
@@ -383,21 +548,9 @@ void getHighESpeed()
   }
   
   float high=0.0;
-  uint8_t block_index = block_buffer_tail;
-  
-  while(block_index != block_buffer_head) {
-    if((block_buffer[block_index].steps_x != 0) ||
-       (block_buffer[block_index].steps_y != 0) ||
-       (block_buffer[block_index].steps_z != 0)) {
-      float se=(float(block_buffer[block_index].steps_e)/float(block_buffer[block_index].step_event_count))*block_buffer[block_index].nominal_speed;
-      //se; mm/sec;
-      if(se>high)
-      {
-        high=se;
-      }
-    }
-    block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
-  }
+  e_speed_drop_discarded();
+  if(e_speed_tail != e_speed_head)
+    high=e_speed[e_speed_tail];
    
   float g=autotemp_min+high*autotemp_factor;
   float t=g;
@@ -415,38 +568,23 @@ void getHighESpeed()
 #endif
 
 void check_axes_activity() {
-  unsigned char x_active = 0;
-  unsigned char y_active = 0;  
-  unsigned char z_active = 0;
-  unsigned char e_active = 0;
-  unsigned char fan_speed = 0;
   unsigned char tail_fan_speed = 0;
-  block_t *block;
+  uint8_t block_index = block_buffer_tail;
 
-  if(block_buffer_tail != block_buffer_head) {
-    uint8_t block_index = block_buffer_tail;
+  if(block_index != block_buffer_head) {
     tail_fan_speed = block_buffer[block_index].fan_speed;
-    while(block_index != block_buffer_head) {
-      block = &block_buffer[block_index];
-      if(block->steps_x != 0) x_active++;
-      if(block->steps_y != 0) y_active++;
-      if(block->steps_z != 0) z_active++;
-      if(block->steps_e != 0) e_active++;
-      if(block->fan_speed != 0) fan_speed++;
-      block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
-    }
   }
   else {
     #if FAN_PIN > -1
       if (FanSpeed != 0) analogWrite(FAN_PIN,FanSpeed); // If buffer is empty use current fan speed
     #endif
   }
-  if((DISABLE_X) && (x_active == 0)) disable_x();
-  if((DISABLE_Y) && (y_active == 0)) disable_y();
-  if((DISABLE_Z) && (z_active == 0)) disable_z();
-  if((DISABLE_E) && (e_active == 0)) { disable_e0();disable_e1();disable_e2(); }
+  if((DISABLE_X) && (block_buffer_axis_count[X_AXIS] == 0)) disable_x();
+  if((DISABLE_Y) && (block_buffer_axis_count[Y_AXIS] == 0)) disable_y();
+  if((DISABLE_Z) && (block_buffer_axis_count[Z_AXIS] == 0)) disable_z();
+  if((DISABLE_E) && (block_buffer_axis_count[E_AXIS] == 0)) { disable_e0();disable_e1();disable_e2(); }
   #if FAN_PIN > -1
-    if((FanSpeed == 0) && (fan_speed ==0)) analogWrite(FAN_PIN, 0);
+    if((FanSpeed == 0) && (block_buffer_fan_count == 0)) analogWrite(FAN_PIN, 0);
   #endif
   if (FanSpeed != 0 && tail_fan_speed !=0) { 
     analogWrite(FAN_PIN,tail_fan_speed);
@@ -454,7 +592,6 @@ void check_axes_activity() {
 }
 
 
-float junction_deviation = 0.1;
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in 
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
@@ -555,9 +692,9 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
 //  }
 
 // TODO - JMG - SORT OUT RETRACTS WHEN e IS NOT ALONE
-  block->millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) +
-                            square(delta_mm[Z_AXIS]) + square(delta_mm[E_AXIS]));
-  float inverse_millimeters = 1.0/block->millimeters;  // Inverse millimeters to remove multiple divides 
+  float millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) +
+                           square(delta_mm[Z_AXIS]) + square(delta_mm[E_AXIS]));
+  float inverse_millimeters = 1.0/millimeters;  // Inverse millimeters to remove multiple divides 
   
   // Calculate speed in mm/second for each axis. No divide by zero due to previous checks.
   float inverse_second = feed_rate * inverse_millimeters;
@@ -572,17 +709,18 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   #ifdef SLOWDOWN
   //  segment time im micro seconds
   unsigned long segment_time = lround(1000000.0/inverse_second);
-  if ((moves_queued > 1) && (moves_queued < (BLOCK_BUFFER_SIZE * 0.5))) {
+  unsigned long buffered_time = block_buffer_runtime();
+  if ((moves_queued > 1) && (buffered_time < SLOWDOWN_MIN_BUFFER_TIME)) {
     if (segment_time < minsegmenttime)  { // buffer is draining, add extra time.  The amount of time added increases if the buffer is still emptied more.
-        inverse_second=1000000.0/(segment_time+lround(2*(minsegmenttime-segment_time)/moves_queued));
+        inverse_second=1000000.0/(segment_time+lround((minsegmenttime-segment_time)*(float)(SLOWDOWN_MIN_BUFFER_TIME-buffered_time)/SLOWDOWN_MIN_BUFFER_TIME));
     }
   }
   #endif
   //  END OF SLOW DOWN SECTION    
 
   
-  block->nominal_speed = block->millimeters * inverse_second; // (mm/sec) Always > 0
-  block->nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
+  block->nominal_speed = millimeters * inverse_second; // (mm/sec) Always > 0
+  float nominal_rate = block->step_event_count * inverse_second; // (step/sec) Always > 0
 
  // Calculate and limit speed in mm/sec for each axis
   float current_speed[4];
@@ -592,6 +730,9 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     if(fabs(current_speed[i]) > max_feedrate[i])
       speed_factor = min(speed_factor, max_feedrate[i] / fabs(current_speed[i]));
   }
+  // The stepper can't go faster anyway, and the step rates in block_t are 16 bit
+  if(nominal_rate > MAX_STEP_FREQUENCY)
+    speed_factor = min(speed_factor, MAX_STEP_FREQUENCY / nominal_rate);
 
 // Max segement time in us.
 #ifdef XY_FREQUENCY_LIMIT
@@ -629,69 +770,42 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
       current_speed[i] *= speed_factor;
     }
     block->nominal_speed *= speed_factor;
-    block->nominal_rate *= speed_factor;
+    nominal_rate *= speed_factor;
   }
+  block->nominal_rate = ceil(nominal_rate);
 
   // Compute and limit the acceleration rate for the trapezoid generator.  
-  float steps_per_mm = block->step_event_count/block->millimeters;
+  float steps_per_mm = block->step_event_count/millimeters;
   if(block->steps_x == 0 && block->steps_y == 0 && block->steps_z == 0) {
     block->acceleration_st = ceil(retract_acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
   }
   else {
-    block->acceleration_st = ceil(acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
-    // Limit acceleration per axis
-    if(((float)block->acceleration_st * (float)block->steps_x / (float)block->step_event_count) > axis_steps_per_sqr_second[X_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[X_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_y / (float)block->step_event_count) > axis_steps_per_sqr_second[Y_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[Y_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_e / (float)block->step_event_count) > axis_steps_per_sqr_second[E_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[E_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_z / (float)block->step_event_count ) > axis_steps_per_sqr_second[Z_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[Z_AXIS];
-  }
-  block->acceleration = block->acceleration_st / steps_per_mm;
+    if(block->steps_e == 0) {
+      block->acceleration_st = ceil(travel_acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
+    }
+    else {
+      block->acceleration_st = ceil(acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
+    }
+    // Limit acceleration per axis. Each axis only does its share of the steps, so it only sees that share
+    // of the acceleration.
+    limit_axis_acceleration(block->acceleration_st, block->steps_x, block->step_event_count, axis_steps_per_sqr_second[X_AXIS]);
+    limit_axis_acceleration(block->acceleration_st, block->steps_y, block->step_event_count, axis_steps_per_sqr_second[Y_AXIS]);
+    limit_axis_acceleration(block->acceleration_st, block->steps_z, block->step_event_count, axis_steps_per_sqr_second[Z_AXIS]);
+    limit_axis_acceleration(block->acceleration_st, block->steps_e, block->step_event_count, axis_steps_per_sqr_second[E_AXIS]);
+  }
+  float block_acceleration = block->acceleration_st / steps_per_mm; // mm/sec^2
+  block->delta_speed_sqr = 2.0*block_acceleration*millimeters;
   block->acceleration_rate = (long)((float)block->acceleration_st * 8.388608);
   
-#if 0  // Use old jerk for now
-  // Compute path unit vector
-  double unit_vec[3];
-
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
-  
-  // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
-  // Let a circle be tangent to both previous and current path line segments, where the junction
-  // deviation is defined as the distance from the junction to the closest edge of the circle,
-  // colinear with the circle center. The circular segment joining the two paths represents the
-  // path of centripetal acceleration. Solve for max velocity based on max acceleration about the
-  // radius of the circle, defined indirectly by junction deviation. This may be also viewed as
-  // path width or max_jerk in the previous grbl version. This approach does not actually deviate
-  // from path, but used as a robust way to compute cornering speeds, as it takes into account the
-  // nonlinearities of both the junction angle and junction velocity.
-  double vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
-
-  // Skip first block or when previous_nominal_speed is used as a flag for homing and offset cycles.
-  if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0)) {
-    // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
-    // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-    double cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
-                       - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
-                       - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
-                           
-    // Skip and use default max junction speed for 0 degree acute junction.
-    if (cos_theta < 0.95) {
-      vmax_junction = min(previous_nominal_speed,block->nominal_speed);
-      // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
-      if (cos_theta > -0.95) {
-        // Compute maximum junction velocity based on maximum acceleration and junction deviation
-        double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
-        vmax_junction = min(vmax_junction,
-          sqrt(block->acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
-      }
-    }
+  // Compute path unit vector. The extruder does not change the direction of the path.
+  float unit_vec[3] = { 0.0, 0.0, 0.0 };
+  if(block->steps_x != 0 || block->steps_y != 0 || block->steps_z != 0) {
+    float inverse_xyz_millimeters = 1.0/sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
+    unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_xyz_millimeters;
+    unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_xyz_millimeters;
+    unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_xyz_millimeters;
   }
-#endif
+
   // Start with a safe speed
   float vmax_junction = max_xy_jerk/2;  
   if(fabs(current_speed[Z_AXIS]) > max_z_jerk/2) 
@@ -701,16 +815,49 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     vmax_junction = min(vmax_junction, max_e_jerk/2);
     
   if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
-    float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
-    if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
-      vmax_junction = block->nominal_speed;
+    // Junction deviation needs a direction on both sides of the junction, extruder only moves use the jerk limits.
+    if ((cornering_mode == CORNERING_JUNCTION_DEVIATION) &&
+        (unit_vec[X_AXIS] != 0 || unit_vec[Y_AXIS] != 0 || unit_vec[Z_AXIS] != 0) &&
+        (previous_unit_vec[X_AXIS] != 0 || previous_unit_vec[Y_AXIS] != 0 || previous_unit_vec[Z_AXIS] != 0)) {
+      // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
+      // Let a circle be tangent to both previous and current path line segments, where the junction
+      // deviation is defined as the distance from the junction to the closest edge of the circle,
+      // colinear with the circle center. The circular segment joining the two paths represents the
+      // path of centripetal acceleration. Solve for max velocity based on max acceleration about the
+      // radius of the circle, defined indirectly by junction deviation. This approach does not actually
+      // deviate from path, but used as a robust way to compute cornering speeds, as it takes into account
+      // the nonlinearities of both the junction angle and junction velocity.
+      // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
+      // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
+      float cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
+                        - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
+                        - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
+                           
+      // Skip and use the safe speed for 0 degree acute junctions.
+      if (cos_theta < 0.95) {
+        vmax_junction = min(previous_nominal_speed,block->nominal_speed);
+        // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
+        if (cos_theta > -0.95) {
+          // Compute maximum junction velocity based on maximum acceleration and junction deviation
+          float sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
+          vmax_junction = min(vmax_junction,
+            sqrt(block_acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
+        }
+      }
     }
-    if (jerk > max_xy_jerk) {
-      vmax_junction *= (max_xy_jerk/jerk);
-    } 
-    if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
-      vmax_junction *= (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]));
-    } 
+    else {
+      float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
+      if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
+        vmax_junction = block->nominal_speed;
+      }
+      if (jerk > max_xy_jerk) {
+        vmax_junction *= (max_xy_jerk/jerk);
+      } 
+      if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
+        vmax_junction *= (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]));
+      } 
+    }
+    // The extruder can't follow a sudden change of extrusion rate in either mode
     if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) > max_e_jerk) {
       vmax_junction *= (max_e_jerk/fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]));
     } 
@@ -718,7 +865,7 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   block->max_entry_speed = vmax_junction;
     
   // Initialize block entry speed. Compute based on deceleration to user-defined MINIMUM_PLANNER_SPEED.
-  double v_allowable = max_allowable_speed(-block->acceleration,MINIMUM_PLANNER_SPEED,block->millimeters);
+  double v_allowable = max_allowable_speed(block->delta_speed_sqr,MINIMUM_PLANNER_SPEED);
   block->entry_speed = min(vmax_junction, v_allowable);
 
   // Initialize planner efficiency flags
@@ -729,12 +876,12 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   // block nominal speed limits both the current and next maximum junction speeds. Hence, in both
   // the reverse and forward planners, the corresponding block junction speed will always be at the
   // the maximum junction speed and may always be ignored for any speed reduction checks.
-  if (block->nominal_speed <= v_allowable) { block->nominal_length_flag = true; }
-  else { block->nominal_length_flag = false; }
-  block->recalculate_flag = true; // Always calculate trapezoid for new block
+  block->flag = BLOCK_FLAG_RECALCULATE; // Always calculate trapezoid for new block
+  if (block->nominal_speed <= v_allowable) { block->flag |= BLOCK_FLAG_NOMINAL_LENGTH; }
   
   // Update previous path unit_vector and nominal speed
   memcpy(previous_speed, current_speed, sizeof(previous_speed)); // previous_speed[] = current_speed[]
+  memcpy(previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
   previous_nominal_speed = block->nominal_speed;
 
   
@@ -766,10 +913,26 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   #endif // ADVANCE
 
   calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
-    MINIMUM_PLANNER_SPEED/block->nominal_speed);
+    MINIMUM_PLANNER_SPEED/block->nominal_speed, block->nominal_rate);
     
+  block->segment_time_us = lround(millimeters/block->nominal_speed*1000000.0);
+
+  #ifdef AUTOTEMP
+    if((block->steps_x != 0) || (block->steps_y != 0) || (block->steps_z != 0)) {
+      e_speed_push(block_buffer_head, (float(block->steps_e)/float(block->step_event_count))*block->nominal_speed);
+    }
+  #endif
+
   // Move buffer head
+  CRITICAL_SECTION_START;
   block_buffer_head = next_buffer_head;
+  block_buffer_runtime_us += block->segment_time_us;
+  if(block->steps_x != 0) block_buffer_axis_count[X_AXIS]++;
+  if(block->steps_y != 0) block_buffer_axis_count[Y_AXIS]++;
+  if(block->steps_z != 0) block_buffer_axis_count[Z_AXIS]++;
+  if(block->steps_e != 0) block_buffer_axis_count[E_AXIS]++;
+  if(block->fan_speed != 0) block_buffer_fan_count++;
+  CRITICAL_SECTION_END;
   
   // Update position
   memcpy(position, target, sizeof(target)); // position[] = target[]
@@ -779,6 +942,189 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   st_wake_up();
 }
 
+void plan_buffer_dwell(unsigned long milliseconds)
+{
+  int next_buffer_head = next_block_index(block_buffer_head);
+
+  // Rest here until there is room in the buffer, like plan_buffer_line()
+  while(block_buffer_tail == next_buffer_head) { 
+    manage_heater(); 
+    manage_inactivity(1); 
+    LCD_STATUS;
+    LED_STATUS;
+  }
+
+  // A block without steps. The stepper interrupt waits segment_time_us when it gets to it. Its entry speed of 0
+  // makes the block before it stop at its end, the planner skips its trapezoid.
+  block_t *block = &block_buffer[block_buffer_head];
+  block->busy = false;
+  block->steps_x = 0;
+  block->steps_y = 0;
+  block->steps_z = 0;
+  block->steps_e = 0;
+  block->step_event_count = 0;
+  block->direction_bits = 0;
+  block->active_extruder = active_extruder;
+  block->fan_speed = FanSpeed;
+  block->nominal_speed = 0.0;
+  block->entry_speed = 0.0;
+  block->max_entry_speed = 0.0;
+  block->delta_speed_sqr = 0.0;
+  block->flag = BLOCK_FLAG_NOMINAL_LENGTH;
+  block->segment_time_us = milliseconds*1000;
+
+  // The move after it starts from rest
+  previous_nominal_speed = 0.0;
+  memset(previous_speed, 0, sizeof(previous_speed));
+  memset(previous_unit_vec, 0, sizeof(previous_unit_vec));
+
+  CRITICAL_SECTION_START;
+  block_buffer_head = next_buffer_head;
+  block_buffer_runtime_us += block->segment_time_us;
+  if(block->fan_speed != 0) block_buffer_fan_count++;
+  CRITICAL_SECTION_END;
+
+  planner_recalculate();
+
+  st_wake_up();
+}
+
+// The nominal step rate of a block whose nominal_speed and segment_time_us were changed by plan_scale_feed_rate()
+FORCE_INLINE unsigned short scaled_nominal_rate(block_t *block)
+{
+  return min(ceil(block->step_event_count*1000000.0/block->segment_time_us), (float)MAX_STEP_FREQUENCY);
+}
+
+// Lowers max_speed (mm/sec along a block of the given length) so that an axis making steps of the block's
+// steps stays within its max_feedrate.
+FORCE_INLINE void limit_axis_speed(float &max_speed, long steps, uint8_t axis, float millimeters)
+{
+  if(steps != 0) max_speed = min(max_speed, max_feedrate[axis]*axis_steps_per_unit[axis]*millimeters/steps);
+}
+
+// Changes the speed of the blocks that haven't started yet by factor and plans them again. Used when the
+// feed rate override changes, so it takes effect without waiting for the buffer to drain.
+// The oldest block is left as it is even if it hasn't started yet, the stepper interrupt may start it any time
+// while this runs. Neither can the entry speed of the block after it change, which is the exit speed of the
+// oldest block. When slowing down, the blocks after it may have to keep a higher speed until it can be lost by
+// decelerating. Junction speeds are never raised, the limits they came from aren't stored, but the old junction
+// speeds are safe at higher speeds too.
+void plan_scale_feed_rate(float factor)
+{
+  if(block_buffer_tail == block_buffer_head) return;
+  uint8_t block_index = next_block_index(block_buffer_tail);
+  if(block_index == block_buffer_head) return;
+  uint8_t first_block = block_index;
+  block_buffer_planned = first_block;
+
+  float junction_factor = min(factor, 1.0);
+  float min_entry_speed = 0.0; // The lowest speed a block can be entered with, from the first block on
+  float previous_block_speed = 0.0;
+  float speed_change = 1.0;
+  block_t *block;
+  while(block_index != block_buffer_head) {
+    block = &block_buffer[block_index];
+    if(block->step_event_count == 0) { // A dwell, its time doesn't change and the next block starts from rest
+      previous_block_speed = 0.0;
+      min_entry_speed = 0.0;
+      block_index = next_block_index(block_index);
+      continue;
+    }
+    float millimeters = block->nominal_speed*block->segment_time_us*0.000001;
+
+    // The same limits as in plan_buffer_line()
+    float nominal_speed = block->nominal_speed*factor;
+    if(block->steps_e == 0) {
+      nominal_speed = max(nominal_speed, mintravelfeedrate);
+    }
+    else {
+      nominal_speed = max(nominal_speed, minimumfeedrate);
+    }
+    float max_speed = MAX_STEP_FREQUENCY*millimeters/block->step_event_count;
+    limit_axis_speed(max_speed, block->steps_x, X_AXIS, millimeters);
+    limit_axis_speed(max_speed, block->steps_y, Y_AXIS, millimeters);
+    limit_axis_speed(max_speed, block->steps_z, Z_AXIS, millimeters);
+    limit_axis_speed(max_speed, block->steps_e, E_AXIS, millimeters);
+    nominal_speed = min(nominal_speed, max_speed);
+    nominal_speed = max(nominal_speed, min_entry_speed);
+
+    if(block_index != first_block) {
+      float max_entry_speed = max(min(block->max_entry_speed*junction_factor, min(nominal_speed, previous_block_speed)), min_entry_speed);
+      float entry_speed = max(min(max_entry_speed, max_allowable_speed(block->delta_speed_sqr, MINIMUM_PLANNER_SPEED)), min_entry_speed);
+      // The block before may have started by now, then this one is entered at the speed it was planned with
+      CRITICAL_SECTION_START;
+      if(block_buffer[prev_block_index(block_index)].busy) {
+        first_block = block_index;
+        block_buffer_planned = first_block;
+      }
+      else {
+        block->max_entry_speed = max_entry_speed;
+        block->entry_speed = entry_speed;
+      }
+      CRITICAL_SECTION_END;
+    }
+    if(block_index == first_block) {
+      min_entry_speed = block->entry_speed;
+      nominal_speed = max(nominal_speed, min_entry_speed);
+    }
+    speed_change = nominal_speed/block->nominal_speed;
+    block->nominal_speed = nominal_speed;
+    block->flag = BLOCK_FLAG_RECALCULATE;
+    if(nominal_speed <= max_allowable_speed(block->delta_speed_sqr, MINIMUM_PLANNER_SPEED)) {
+      block->flag |= BLOCK_FLAG_NOMINAL_LENGTH;
+    }
+    #ifdef ADVANCE
+      block->advance *= speed_change*speed_change;
+    #endif
+
+    unsigned long segment_time_us = lround(millimeters/nominal_speed*1000000.0);
+    CRITICAL_SECTION_START;
+    if(block->busy == false) { // The stepper interrupt subtracts the time of the blocks it discards
+      block_buffer_runtime_us += segment_time_us - block->segment_time_us;
+      block->segment_time_us = segment_time_us;
+    }
+    CRITICAL_SECTION_END;
+
+    // Even braking over the whole block, the next one is entered at this speed or faster
+    previous_block_speed = nominal_speed;
+    min_entry_speed = sqrt(max(square(min_entry_speed) - block->delta_speed_sqr, 0.0));
+    block_index = next_block_index(block_index);
+  }
+
+  // The next block joins the last one at its new speed
+  previous_nominal_speed *= speed_change;
+  for(int8_t i=0; i < NUM_AXIS; i++) {
+    previous_speed[i] *= speed_change;
+  }
+  #ifdef AUTOTEMP
+    for(uint8_t i=e_speed_tail; i != e_speed_head; i = (i + 1) & (BLOCK_BUFFER_SIZE - 1)) {
+      e_speed[i] *= factor;
+    }
+  #endif
+
+  planner_reverse_pass();
+  planner_forward_pass();
+
+  // All trapezoids are calculated again, the nominal rates follow from the new segment times
+  block_t *next = NULL;
+  block_index = first_block;
+  while(block_index != block_buffer_head) {
+    block = next;
+    next = &block_buffer[block_index];
+    if(block && block->step_event_count != 0) {
+      calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
+        next->entry_speed/block->nominal_speed, scaled_nominal_rate(block));
+      block->flag &= ~BLOCK_FLAG_RECALCULATE;
+    }
+    block_index = next_block_index(block_index);
+  }
+  if(next->step_event_count != 0) {
+    calculate_trapezoid_for_block(next, next->entry_speed/next->nominal_speed,
+      MINIMUM_PLANNER_SPEED/next->nominal_speed, scaled_nominal_rate(next));
+    next->flag &= ~BLOCK_FLAG_RECALCULATE;
+  }
+}
+
 void plan_set_position(const float &x, const float &y, const float &z, const float &e)
 {
   position[X_AXIS] = lround(x*axis_steps_per_unit[X_AXIS]);
@@ -28,6 +28,8 @@
 
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
+// The fields read by the stepper interrupt come first and are all integers; speeds are step rates limited to
+// MAX_STEP_FREQUENCY, so 16 bits are enough. The floats after them are only used by the planner.
 typedef struct {
   // Fields used by the bresenham algorithm for tracing the line
   long steps_x, steps_y, steps_z, steps_e;  // Step count along each axis
@@ -37,6 +39,8 @@ typedef struct {
   long acceleration_rate;                   // The acceleration rate used for acceleration calculation
   unsigned char direction_bits;             // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
   unsigned char active_extruder;            // Selects the active extruder
+  unsigned char fan_speed;                  // FanSpeed at the time the block was planned
+  volatile char busy;                       // Set by the stepper interrupt, so not part of flag below
   #ifdef ADVANCE
     long advance_rate;
     volatile long initial_advance;
@@ -44,24 +48,43 @@ typedef struct {
     float advance;
   #endif
 
-  // Fields used by the motion planner to manage acceleration
-//  float speed_x, speed_y, speed_z, speed_e;        // Nominal mm/sec for each axis
-  float nominal_speed;                               // The nominal speed for this block in mm/sec 
-  float entry_speed;                                 // Entry speed at previous-current junction in mm/sec
-  float max_entry_speed;                             // Maximum allowable junction entry speed in mm/sec
-  float millimeters;                                 // The total travel of this block in mm
-  float acceleration;                                // acceleration mm/sec^2
-  unsigned char recalculate_flag;                    // Planner flag to recalculate trapezoids on entry junction
-  unsigned char nominal_length_flag;                 // Planner flag for nominal speed always reached
-
   // Settings for the trapezoid generator
-  unsigned long nominal_rate;                        // The nominal step rate for this block in step_events/sec 
-  unsigned long initial_rate;                        // The jerk-adjusted step rate at start of block  
-  unsigned long final_rate;                          // The minimal rate at exit
-  unsigned long acceleration_st;                     // acceleration steps/sec^2
-  unsigned long fan_speed;
-  volatile char busy;
+  unsigned short nominal_rate;              // The nominal step rate for this block in step_events/sec 
+  unsigned short initial_rate;              // The jerk-adjusted step rate at start of block  
+  unsigned short final_rate;                // The minimal rate at exit
+  unsigned long acceleration_st;            // acceleration steps/sec^2
+  #ifdef S_CURVE_ACCELERATION
+    unsigned short cruise_rate;             // The highest step rate reached in this block
+    unsigned long acceleration_ticks;       // Duration of the acceleration ramp in timer ticks
+    unsigned long acceleration_inverse;     // 0xffffffff/acceleration_ticks, locates the ISR in the ramp without a divide
+    unsigned long deceleration_ticks;       // Duration of the deceleration ramp in timer ticks
+    unsigned long deceleration_inverse;     // 0xffffffff/deceleration_ticks
+  #endif
+
+  // Fields used by the motion planner to manage acceleration
+  float nominal_speed;                      // The nominal speed for this block in mm/sec 
+  float entry_speed;                        // Entry speed at previous-current junction in mm/sec
+  float max_entry_speed;                    // Maximum allowable junction entry speed in mm/sec
+  float delta_speed_sqr;                    // 2*acceleration*millimeters, the largest change of speed^2 within this block
+  unsigned long segment_time_us;            // Time to execute this block at nominal speed
+  unsigned char flag;                       // BLOCK_FLAG_* bits
 } block_t;
+// A block with a step_event_count of 0 is a dwell, it waits segment_time_us without moving
+
+// Bits of block_t.flag
+#define BLOCK_FLAG_RECALCULATE     1        // Planner flag to recalculate trapezoids on entry junction
+#define BLOCK_FLAG_NOMINAL_LENGTH  2        // Planner flag for nominal speed always reached
+
+#if MAX_STEP_FREQUENCY > 65535
+  #error MAX_STEP_FREQUENCY does not fit the 16 bit step rates of block_t
+#endif
+#if defined(S_CURVE_ACCELERATION) && defined(ADVANCE)
+  #error ADVANCE assumes constant acceleration, it cannot be used with S_CURVE_ACCELERATION
+#endif
+
+// Ways to calculate the maximum speed at the junction of two blocks
+#define CORNERING_JERK                0 // Limit the instantaneous change of speed per axis (max_xy_jerk, max_z_jerk)
+#define CORNERING_JUNCTION_DEVIATION  1 // Limit the centripetal acceleration around the corner (junction_deviation)
 
 // Initialize the motion plan subsystem      
 void plan_init();
@@ -70,10 +93,17 @@ void plan_init();
 // millimaters. Feed rate specifies the speed of the motion.
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
 
+// Add a dwell (G4) of the given time to the buffer. The moves before it stop at its start, the stepper
+// interrupt waits and then continues with the moves after it, so the planner doesn't have to drain.
+void plan_buffer_dwell(unsigned long milliseconds);
+
 // Set position. Used for G92 instructions.
 void plan_set_position(const float &x, const float &y, const float &z, const float &e);
 void plan_set_e_position(const float &e);
 
+// Change the speed of the buffered blocks that haven't started yet, for a new feed rate override
+void plan_scale_feed_rate(float factor);
+
 
 
 void check_axes_activity();
@@ -85,10 +115,13 @@ extern float axis_steps_per_unit[4];
 extern unsigned long max_acceleration_units_per_sq_second[4]; // Use M201 to override by software
 extern float minimumfeedrate;
 extern float acceleration;         // Normal acceleration mm/s^2  THIS IS THE DEFAULT ACCELERATION for all moves. M204 SXXXX
-extern float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 TXXXX
+extern float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 RXXXX
+extern float travel_acceleration;  //  mm/s^2   moves without extrusion M204 TXXXX
 extern float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 extern float max_z_jerk;
 extern float max_e_jerk;
+extern unsigned char cornering_mode; // CORNERING_JERK or CORNERING_JUNCTION_DEVIATION, M205 C
+extern float junction_deviation;     // mm, used in CORNERING_JUNCTION_DEVIATION mode
 extern float mintravelfeedrate;
 extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 
@@ -105,11 +138,21 @@ extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail; 
+extern volatile unsigned long block_buffer_runtime_us;     // Sum of segment_time_us of the blocks in the buffer
+extern volatile unsigned char block_buffer_axis_count[NUM_AXIS]; // Number of blocks in the buffer that move each axis
+extern volatile unsigned char block_buffer_fan_count;      // Number of blocks in the buffer with the fan on
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 FORCE_INLINE void plan_discard_current_block()  
 {
   if (block_buffer_head != block_buffer_tail) {
+    block_t *block = &block_buffer[block_buffer_tail];
+    block_buffer_runtime_us -= block->segment_time_us;
+    if(block->steps_x != 0) block_buffer_axis_count[X_AXIS]--;
+    if(block->steps_y != 0) block_buffer_axis_count[Y_AXIS]--;
+    if(block->steps_z != 0) block_buffer_axis_count[Z_AXIS]--;
+    if(block->steps_e != 0) block_buffer_axis_count[E_AXIS]--;
+    if(block->fan_speed != 0) block_buffer_fan_count--;
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
   }
 }
@@ -51,17 +51,24 @@ static long counter_x,       // Counter variables for the bresenham line tracer
             counter_y, 
             counter_z,       
             counter_e;
-volatile static unsigned long step_events_completed; // The number of step events executed in the current block
+volatile static unsigned long step_events_completed; // Of the current block, in the same parts as step_event_count
 #ifdef ADVANCE
   static long advance_rate, advance, final_advance = 0;
   static long old_advance = 0;
 #endif
 static long e_steps[3];
 static long acceleration_time, deceleration_time;
-//static unsigned long accelerate_until, decelerate_after, acceleration_rate, initial_rate, final_rate, nominal_rate;
+static unsigned char oversampling;        // The stepper interrupt runs 1<<oversampling times per step, see calc_timer()
+static unsigned long step_event_count;    // Of the current block, in 1<<MAX_STEP_OVERSAMPLING parts of a step event
+static long accelerate_until, decelerate_after;
+static unsigned char step_event_increment; // Parts of a step event the bresenham tracer advances per interrupt
+static long step_increment_x, step_increment_y, step_increment_z, step_increment_e;
 static unsigned short acc_step_rate; // needed for deccelaration start point
 static char step_loops;
 static unsigned short OCR1A_nominal;
+static char nominal_step_loops;
+static unsigned char nominal_oversampling;
+static unsigned long dwell_left_us;       // Time the current block still waits if it is a dwell
 
 volatile long endstops_trigsteps[3]={0,0,0};
 volatile long endstops_stepsTotal,endstops_stepsDone;
@@ -76,6 +83,53 @@ static bool old_z_max_endstop=false;
 
 static bool check_endstops = true;
 
+// Bits of endstops_to_check
+#define ENDSTOP_X_MIN 1
+#define ENDSTOP_X_MAX 2
+#define ENDSTOP_Y_MIN 4
+#define ENDSTOP_Y_MAX 8
+#define ENDSTOP_Z_MIN 16
+#define ENDSTOP_Z_MAX 32
+static unsigned char endstops_to_check; // The endstops the current block moves towards
+
+// Pin change interrupts are available on all pins of the ATmega644P/1284P only, PCMSK3 is unique to them
+#if defined(ENDSTOP_INTERRUPTS) && !defined(PCMSK3)
+  #error ENDSTOP_INTERRUPTS needs an ATmega644P/1284P
+#endif
+
+// ADVANCE counts the advance steps per interrupt
+#ifdef ADVANCE
+  #undef MAX_STEP_OVERSAMPLING
+  #define MAX_STEP_OVERSAMPLING 0
+#endif
+
+#ifdef STEP_EVENT_QUEUE
+  #ifdef ADVANCE
+    #error STEP_EVENT_QUEUE cannot be used with ADVANCE, the extruder advance steps are not queued
+  #endif
+  // One interrupt worth of steps, see trace_step_loops()
+  typedef struct {
+    unsigned short interval;                // Timer ticks from these steps to the next event
+    unsigned short bits;
+    #ifdef SPREAD_MULTI_STEPS
+      unsigned short step_interval;         // Timer ticks between the steps
+    #endif
+  } step_event_t;
+  static volatile step_event_t step_events[STEP_EVENT_QUEUE_SIZE]; // Ring of the next step events of the current block
+  static volatile unsigned char step_event_head;  // Index of the next event to be prepared
+  static volatile unsigned char step_event_tail;  // Index of the next event to be output
+  static volatile bool step_events_prepared;      // All events of the current block are in the queue
+  static volatile bool step_events_abort;         // An endstop ended the current block
+  static volatile bool step_events_filling;       // The queue is being refilled with interrupts enabled
+#endif
+
+#ifdef SPREAD_MULTI_STEPS
+  // The steps of the current interrupt that the compare B interrupt still has to pulse, 4 bits per step
+  static volatile unsigned short spread_bits;
+  static unsigned short spread_position;  // Timer count of the last step pulsed
+  static unsigned short spread_interval;  // Timer ticks between the steps
+#endif
+
 volatile long count_position[NUM_AXIS] = { 0, 0, 0, 0};
 volatile char count_direction[NUM_AXIS] = { 1, 1, 1, 1};
 
@@ -85,6 +139,7 @@ volatile char count_direction[NUM_AXIS] = { 1, 1, 1, 1};
 
 #define CHECK_ENDSTOPS  if(check_endstops)
 
+#ifdef __AVR__
 // intRes = intIn1 * intIn2 >> 16
 // uses:
 // r26 to store 0
@@ -154,11 +209,18 @@ asm volatile ( \
 : \
 "r26" , "r27" \
 )
+#else
+// The same in C for the host builds in test/. They may differ from the assembler versions in the lowest bit.
+#define MultiU16X8toH16(intRes, charIn1, intIn2) intRes = ((unsigned long)(charIn1)*(intIn2)) >> 8
+#define MultiU24X24toH16(intRes, longIn1, longIn2) intRes = ((uint64_t)((longIn1) & 0xffffff)*((longIn2) & 0xffffff)) >> 24
+#endif // __AVR__
 
 // Some useful constants
 
 #define ENABLE_STEPPER_DRIVER_INTERRUPT()  TIMSK1 |= (1<<OCIE1A)
 #define DISABLE_STEPPER_DRIVER_INTERRUPT() TIMSK1 &= ~(1<<OCIE1A)
+#define ENABLE_SPREAD_STEPS_INTERRUPT()    TIMSK1 |= (1<<OCIE1B)
+#define DISABLE_SPREAD_STEPS_INTERRUPT()   TIMSK1 &= ~(1<<OCIE1B)
 
 
 void checkHitEndstops()
@@ -215,41 +277,225 @@ void st_wake_up() {
   ENABLE_STEPPER_DRIVER_INTERRUPT();  
 }
 
+// Sets how far the bresenham tracer advances per interrupt at the current oversampling
+FORCE_INLINE void set_step_increments() {
+  unsigned char shift = MAX_STEP_OVERSAMPLING - oversampling;
+  step_increment_x = current_block->steps_x << shift;
+  step_increment_y = current_block->steps_y << shift;
+  step_increment_z = current_block->steps_z << shift;
+  step_increment_e = current_block->steps_e << shift;
+  step_event_increment = 1 << shift;
+}
+
 FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
   unsigned short timer;
   if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
   
-  if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
-    step_rate = (step_rate >> 2)&0x3fff;
-    step_loops = 4;
+  // Take the fewest steps per interrupt that keep the interrupt rate within MAX_STEP_ISR_FREQUENCY
+  step_loops = 1;
+  while((step_rate > MAX_STEP_ISR_FREQUENCY) && (step_loops < 4)) {
+    step_rate >>= 1;
+    step_loops <<= 1;
   }
-  else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
-    step_rate = (step_rate >> 1)&0x7fff;
-    step_loops = 2;
-  }
-  else {
-    step_loops = 1;
-  } 
+  #if MAX_STEP_OVERSAMPLING > 0
+    // and within the budget run the bresenham tracer several times per step instead. The tracer can only
+    // switch to fewer interrupts per step where those start, so the block still ends with its last step.
+    unsigned char new_oversampling = 0;
+    while((new_oversampling < MAX_STEP_OVERSAMPLING) &&
+          (((unsigned long)step_rate << (new_oversampling + 1)) <= MAX_STEP_ISR_FREQUENCY)) {
+      new_oversampling++;
+    }
+    if((new_oversampling > oversampling) || ((new_oversampling < oversampling) &&
+       (((unsigned char)step_events_completed & ((1 << (MAX_STEP_OVERSAMPLING - new_oversampling)) - 1)) == 0))) {
+      oversampling = new_oversampling;
+      set_step_increments();
+    }
+    if(((unsigned long)step_rate << oversampling) > 65535) step_rate = 65535;
+    else step_rate <<= oversampling;
+  #endif
   
   if(step_rate < (F_CPU/500000)) step_rate = (F_CPU/500000);
   step_rate -= (F_CPU/500000); // Correct for minimal speed
   if(step_rate >= (8*256)){ // higher step rate 
-    unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
+    const uint16_t *table_address = speed_lookuptable_fast[(unsigned char)(step_rate>>8)];
     unsigned char tmp_step_rate = (step_rate & 0x00ff);
-    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+2);
+    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+1);
     MultiU16X8toH16(timer, tmp_step_rate, gain);
     timer = (unsigned short)pgm_read_word_near(table_address) - timer;
   }
   else { // lower step rates
-    unsigned short table_address = (unsigned short)&speed_lookuptable_slow[0][0];
-    table_address += ((step_rate)>>1) & 0xfffc;
+    const uint16_t *table_address = speed_lookuptable_slow[step_rate>>3];
     timer = (unsigned short)pgm_read_word_near(table_address);
-    timer -= (((unsigned short)pgm_read_word_near(table_address+2) * (unsigned char)(step_rate & 0x0007))>>3);
+    timer -= (((unsigned short)pgm_read_word_near(table_address+1) * (unsigned char)(step_rate & 0x0007))>>3);
   }
   if(timer < 100) { timer = 100; MYSERIAL.print(MSG_STEPPER_TO_HIGH); MYSERIAL.println(step_rate); }//(20kHz this should never happen)
   return timer;
 }
 
+#ifdef S_CURVE_ACCELERATION
+// Constants of the normalized S-curve S(x), x and S in 0..1 as 16 bit fractions. With j = S_CURVE_JERK_PART:
+//   x < j:        S = x^2 / (2 j (1-j))                 acceleration builds up
+//   x <= 1-j:     S = (x - j/2) / (1-j)                 constant acceleration
+//   x > 1-j:      S = 1 - (1-x)^2 / (2 j (1-j))         acceleration fades out
+#define S_CURVE_JERK_X        ((unsigned short)(S_CURVE_JERK_PART*65536.0))
+#define S_CURVE_JERK_FACTOR   ((unsigned short)(4096.0/(2.0*S_CURVE_JERK_PART*(1.0-S_CURVE_JERK_PART)) + 0.5)) // 4.12 fixed point
+#define S_CURVE_LINEAR_FACTOR ((unsigned short)(4096.0/(1.0-S_CURVE_JERK_PART) + 0.5))                         // 4.12 fixed point
+
+// Returns the part of delta_rate reached after time of a ramp that takes ticks timer ticks. inverse is 0xffffffff/ticks.
+FORCE_INLINE unsigned short s_curve_rate(unsigned long time, unsigned long ticks, unsigned long inverse, unsigned short delta_rate) {
+  if(time >= ticks) return delta_rate;
+  unsigned short x = (time*inverse) >> 16;
+  unsigned long s;
+  if(x < S_CURVE_JERK_X) {
+    s = ((((unsigned long)x*x) >> 16)*S_CURVE_JERK_FACTOR) >> 12;
+  }
+  else if(x <= (unsigned short)(65535 - S_CURVE_JERK_X)) {
+    s = ((unsigned long)(x - (S_CURVE_JERK_X >> 1))*S_CURVE_LINEAR_FACTOR) >> 12;
+  }
+  else {
+    unsigned short y = 65535 - x;
+    s = 65536 - (((((unsigned long)y*y) >> 16)*S_CURVE_JERK_FACTOR) >> 12);
+  }
+  if(s > 65536) s = 65536;
+  return (s*delta_rate) >> 16;
+}
+#endif // S_CURVE_ACCELERATION
+
+// Sets the direction pins for the current block and selects the endstops the stepper interrupt has to read:
+// those of the axes that move, on the side they move towards. Called whenever a new block begins. It takes about
+// 80 cycles once per block in place of about 59 in every interrupt on the Melzi: 4 direction writes, 4
+// count_direction stores and 3 tests of check_endstops. While homing an axis the endstop part of the interrupt
+// takes about 26 cycles instead of 69.
+FORCE_INLINE void set_directions() {
+  out_bits = current_block->direction_bits;
+  endstops_to_check = 0;
+
+  if ((out_bits & (1<<X_AXIS)) != 0) {   // -direction
+    WRITE(X_DIR_PIN, INVERT_X_DIR);
+    count_direction[X_AXIS]=-1;
+    if(current_block->steps_x > 0) endstops_to_check |= ENDSTOP_X_MIN;
+  }
+  else { // +direction 
+    WRITE(X_DIR_PIN,!INVERT_X_DIR);
+    count_direction[X_AXIS]=1;
+    if(current_block->steps_x > 0) endstops_to_check |= ENDSTOP_X_MAX;
+  }
+
+  if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
+    WRITE(Y_DIR_PIN,INVERT_Y_DIR);
+    count_direction[Y_AXIS]=-1;
+    if(current_block->steps_y > 0) endstops_to_check |= ENDSTOP_Y_MIN;
+  }
+  else { // +direction
+    WRITE(Y_DIR_PIN,!INVERT_Y_DIR);
+    count_direction[Y_AXIS]=1;
+    if(current_block->steps_y > 0) endstops_to_check |= ENDSTOP_Y_MAX;
+  }
+
+  if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
+    WRITE(Z_DIR_PIN,INVERT_Z_DIR);
+    count_direction[Z_AXIS]=-1;
+    if(current_block->steps_z > 0) endstops_to_check |= ENDSTOP_Z_MIN;
+  }
+  else { // +direction
+    WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
+    count_direction[Z_AXIS]=1;
+    if(current_block->steps_z > 0) endstops_to_check |= ENDSTOP_Z_MAX;
+  }
+
+  #ifndef ADVANCE
+    if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
+      REV_E_DIR();
+      count_direction[E_AXIS]=-1;
+    }
+    else { // +direction
+      NORM_E_DIR();
+      count_direction[E_AXIS]=1;
+    }
+  #endif //!ADVANCE
+}
+
+// Stops the current block where it is, when an endstop was hit
+FORCE_INLINE void end_current_block() {
+  #ifdef STEP_EVENT_QUEUE
+    step_event_tail = step_event_head; // Drop the steps that were prepared but not output yet
+    step_events_abort = true;
+  #else
+    step_events_completed = step_event_count;
+  #endif
+  #ifdef SPREAD_MULTI_STEPS
+    spread_bits = 0;
+  #endif
+}
+
+#ifdef ENDSTOP_INTERRUPTS
+// Reads the endstops the current block moves towards and ends the block at the position the first closed one
+// was hit. The stepper interrupt can't run while this does, so count_position is the position of the switch.
+static void endstops_changed() {
+  if((current_block == NULL) || !check_endstops) return;
+  #if X_MIN_PIN > -1
+    if((endstops_to_check & ENDSTOP_X_MIN) && (READ(X_MIN_PIN) != X_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+      endstop_x_hit=true;
+      end_current_block();
+    }
+  #endif
+  #if X_MAX_PIN > -1
+    if((endstops_to_check & ENDSTOP_X_MAX) && (READ(X_MAX_PIN) != X_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+      endstop_x_hit=true;
+      end_current_block();
+    }
+  #endif
+  #if Y_MIN_PIN > -1
+    if((endstops_to_check & ENDSTOP_Y_MIN) && (READ(Y_MIN_PIN) != Y_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+      endstop_y_hit=true;
+      end_current_block();
+    }
+  #endif
+  #if Y_MAX_PIN > -1
+    if((endstops_to_check & ENDSTOP_Y_MAX) && (READ(Y_MAX_PIN) != Y_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+      endstop_y_hit=true;
+      end_current_block();
+    }
+  #endif
+  #if Z_MIN_PIN > -1
+    if((endstops_to_check & ENDSTOP_Z_MIN) && (READ(Z_MIN_PIN) != Z_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+      endstop_z_hit=true;
+      end_current_block();
+    }
+  #endif
+  #if Z_MAX_PIN > -1
+    if((endstops_to_check & ENDSTOP_Z_MAX) && (READ(Z_MAX_PIN) != Z_ENDSTOPS_INVERTING)) {
+      endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+      endstop_z_hit=true;
+      end_current_block();
+    }
+  #endif
+}
+
+// Enables the pin change interrupt of an endstop pin. The pin change interrupt group follows the port.
+FORCE_INLINE void enable_endstop_interrupt(volatile uint8_t *port, uint8_t mask) {
+  if(port == &PINA) { PCMSK0 |= mask; PCICR |= (1<<PCIE0); }
+  else if(port == &PINB) { PCMSK1 |= mask; PCICR |= (1<<PCIE1); }
+  else if(port == &PINC) { PCMSK2 |= mask; PCICR |= (1<<PCIE2); }
+  else { PCMSK3 |= mask; PCICR |= (1<<PCIE3); }
+}
+#define _ENABLE_ENDSTOP_INTERRUPT(IO) enable_endstop_interrupt(&DIO ## IO ## _RPORT, MASK(DIO ## IO ## _PIN))
+#define ENABLE_ENDSTOP_INTERRUPT(IO) _ENABLE_ENDSTOP_INTERRUPT(IO)
+
+ISR(PCINT0_vect)
+{
+  endstops_changed();
+}
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(PCINT3_vect, ISR_ALIASOF(PCINT0_vect));
+#endif //ENDSTOP_INTERRUPTS
+
 // Initializes the trapezoid generator from the current block. Called whenever a new 
 // block begins.
 FORCE_INLINE void trapezoid_generator_reset() {
@@ -260,12 +506,21 @@ FORCE_INLINE void trapezoid_generator_reset() {
     e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
     old_advance = advance >>8;  
   #endif
+  step_event_count = current_block->step_event_count << MAX_STEP_OVERSAMPLING;
+  accelerate_until = current_block->accelerate_until << MAX_STEP_OVERSAMPLING;
+  decelerate_after = current_block->decelerate_after << MAX_STEP_OVERSAMPLING;
+  step_events_completed = 0;
+  oversampling = 0;
+  set_step_increments();
+
+  OCR1A_nominal = calc_timer(current_block->nominal_rate);
+  nominal_step_loops = step_loops;
+  nominal_oversampling = oversampling;
   deceleration_time = 0;
   // step_rate to timer interval
   acc_step_rate = current_block->initial_rate;
   acceleration_time = calc_timer(acc_step_rate);
   OCR1A = acceleration_time;
-  OCR1A_nominal = calc_timer(current_block->nominal_rate);
   
 
   
@@ -281,22 +536,304 @@ FORCE_INLINE void trapezoid_generator_reset() {
     
 }
 
+// Runs the acceleration ramp after a step event and returns the timer ticks to the next one
+FORCE_INLINE unsigned short next_step_interval() {
+  unsigned short timer;
+  unsigned short step_rate;
+  if (step_events_completed <= (unsigned long)accelerate_until) {
+    
+    #ifdef S_CURVE_ACCELERATION
+      acc_step_rate = s_curve_rate(acceleration_time, current_block->acceleration_ticks, current_block->acceleration_inverse,
+        current_block->cruise_rate - current_block->initial_rate);
+    #else
+      MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
+    #endif
+    acc_step_rate += current_block->initial_rate;
+    
+    // upper limit
+    if(acc_step_rate > current_block->nominal_rate)
+      acc_step_rate = current_block->nominal_rate;
+
+    // step_rate to timer interval
+    timer = calc_timer(acc_step_rate);
+    acceleration_time += timer;
+    #ifdef ADVANCE
+      for(int8_t i=0; i < step_loops; i++) {
+        advance += advance_rate;
+      }
+      //if(advance > current_block->advance) advance = current_block->advance;
+      // Do E steps + advance steps
+      e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
+      old_advance = advance >>8;  
+      
+    #endif
+  } 
+  else if (step_events_completed > (unsigned long)decelerate_after) {   
+    #ifdef S_CURVE_ACCELERATION
+      // Ramp down from wherever the acceleration ended
+      step_rate = 0;
+      if(acc_step_rate > current_block->final_rate) {
+        step_rate = s_curve_rate(deceleration_time, current_block->deceleration_ticks, current_block->deceleration_inverse,
+          acc_step_rate - current_block->final_rate);
+      }
+    #else
+      MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
+    #endif
+    
+    if(step_rate > acc_step_rate) { // Check step_rate stays positive
+      step_rate = current_block->final_rate;
+    }
+    else {
+      step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+    }
+
+    // lower limit
+    if(step_rate < current_block->final_rate)
+      step_rate = current_block->final_rate;
+
+    // step_rate to timer interval
+    timer = calc_timer(step_rate);
+    deceleration_time += timer;
+    #ifdef ADVANCE
+      for(int8_t i=0; i < step_loops; i++) {
+        advance -= advance_rate;
+      }
+      if(advance < final_advance) advance = final_advance;
+      // Do E steps + advance steps
+      e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
+      old_advance = advance >>8;  
+    #endif //ADVANCE
+  }
+  else if((step_loops != nominal_step_loops) || (oversampling != nominal_oversampling)) {
+    timer = calc_timer(current_block->nominal_rate); // The ramp ended with other steps per interrupt
+  }
+  else {
+    timer = OCR1A_nominal;
+  }
+  return timer;
+}
+
+// Runs the bresenham tracer for the step_loops steps of one interrupt and returns which axes step in each of them:
+// bit (axis + 4*i) is set if the axis steps in the i-th step
+FORCE_INLINE unsigned short trace_step_loops() {
+  unsigned short bits = 0;
+  unsigned short step_bit = 1;
+  for(int8_t i=0; i < step_loops; i++) { // Multiple steps per interrupt (For high speed moves)
+    #ifdef ADVANCE
+    counter_e += step_increment_e;
+    if (counter_e > 0) {
+      counter_e -= step_event_count;
+      if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
+        e_steps[current_block->active_extruder]--;
+      }
+      else {
+        e_steps[current_block->active_extruder]++;
+      }
+    }    
+    #endif //ADVANCE
+    counter_x += step_increment_x;
+    if (counter_x > 0) {
+      counter_x -= step_event_count;
+      bits |= step_bit << X_AXIS;
+    }
+    counter_y += step_increment_y;
+    if (counter_y > 0) {
+      counter_y -= step_event_count;
+      bits |= step_bit << Y_AXIS;
+    }
+    counter_z += step_increment_z;
+    if (counter_z > 0) {
+      counter_z -= step_event_count;
+      bits |= step_bit << Z_AXIS;
+    }
+    #ifndef ADVANCE
+    counter_e += step_increment_e;
+    if (counter_e > 0) {
+      counter_e -= step_event_count;
+      bits |= step_bit << E_AXIS;
+    }
+    #endif //!ADVANCE
+    step_bit <<= 4;
+    step_events_completed += step_event_increment;
+    if(step_events_completed >= step_event_count) break;
+  }
+  return bits;
+}
+
+// Timer ticks between the steps of an interrupt that waits interval ticks for the next one
+FORCE_INLINE unsigned short step_loop_interval(unsigned short interval) {
+  if(step_loops == 4) return interval >> 2;
+  if(step_loops == 2) return interval >> 1;
+  return interval;
+}
+
+// Pulses the step pins of the axes in the lowest 4 bits
+FORCE_INLINE void output_step_bits(unsigned char bits) {
+  if(bits & (1<<X_AXIS)) {
+    WRITE(X_STEP_PIN, HIGH);
+    count_position[X_AXIS]+=count_direction[X_AXIS];
+    WRITE(X_STEP_PIN, LOW);
+  }
+  if(bits & (1<<Y_AXIS)) {
+    WRITE(Y_STEP_PIN, HIGH);
+    count_position[Y_AXIS]+=count_direction[Y_AXIS];
+    WRITE(Y_STEP_PIN, LOW);
+  }
+  if(bits & (1<<Z_AXIS)) {
+    WRITE(Z_STEP_PIN, HIGH);
+    count_position[Z_AXIS]+=count_direction[Z_AXIS];
+    WRITE(Z_STEP_PIN, LOW);
+  }
+  #ifndef ADVANCE
+  if(bits & (1<<E_AXIS)) {
+    WRITE_E_STEP(HIGH);
+    count_position[E_AXIS]+=count_direction[E_AXIS];
+    WRITE_E_STEP(LOW);
+  }
+  #endif //!ADVANCE
+}
+
+#ifdef SPREAD_MULTI_STEPS
+// Sets the compare B interrupt to pulse the next steps in spread_bits spread_interval ticks after the last ones.
+// Pulses them right away where the timer is already past their time, and stops the interrupt when all are out.
+FORCE_INLINE void schedule_spread_steps() {
+  while(spread_bits != 0) {
+    spread_position += spread_interval;
+    if(spread_bits & 0x0f) {
+      OCR1B = spread_position;
+      TIFR1 = (1<<OCF1B); // Clears a match from before
+      if(TCNT1 < spread_position) {
+        ENABLE_SPREAD_STEPS_INTERRUPT();
+        return;
+      }
+      output_step_bits(spread_bits);
+    }
+    spread_bits >>= 4;
+  }
+  DISABLE_SPREAD_STEPS_INTERRUPT();
+}
+
+// Pulses the steps of the last interrupt the compare B interrupt didn't get to, before the next ones
+FORCE_INLINE void flush_spread_steps() {
+  while(spread_bits != 0) {
+    output_step_bits(spread_bits);
+    spread_bits >>= 4;
+  }
+}
+
+ISR(TIMER1_COMPB_vect)
+{
+  output_step_bits(spread_bits);
+  spread_bits >>= 4;
+  schedule_spread_steps();
+}
+#endif //SPREAD_MULTI_STEPS
+
+// Pulses the steps of one interrupt from trace_step_loops(), the first right away and the others step_interval
+// timer ticks apart with SPREAD_MULTI_STEPS, else right after each other
+FORCE_INLINE void output_steps(unsigned short bits, unsigned short step_interval) {
+  output_step_bits(bits);
+  #ifdef SPREAD_MULTI_STEPS
+    spread_bits = bits >> 4;
+    if(spread_bits != 0) {
+      spread_position = TCNT1;
+      spread_interval = step_interval;
+      schedule_spread_steps();
+    }
+  #else
+    while((bits >>= 4) != 0) output_step_bits(bits);
+  #endif
+}
+
+#ifdef STEP_EVENT_QUEUE
+// Number of step events that can still be queued
+FORCE_INLINE unsigned char step_events_free() {
+  return (step_event_tail - step_event_head - 1) & (STEP_EVENT_QUEUE_SIZE - 1);
+}
+
+// Traces the current block ahead of the stepper interrupt: runs the bresenham algorithm and the acceleration
+// ramp for up to max_events step events and queues their step bits and intervals.
+static void prepare_step_events(unsigned char max_events) {
+  if(step_events_prepared) return;
+  while(max_events-- && step_events_free()) {
+    if(step_events_abort) {
+      step_events_prepared = true;
+      return;
+    }
+    // The interval first, it sets how many steps the event takes
+    volatile step_event_t *event = &step_events[step_event_head];
+    unsigned short interval = next_step_interval();
+    event->interval = interval;
+    #ifdef SPREAD_MULTI_STEPS
+      event->step_interval = step_loop_interval(interval);
+    #endif
+    event->bits = trace_step_loops();
+    step_event_head = (step_event_head + 1) & (STEP_EVENT_QUEUE_SIZE - 1);
+    if(step_events_completed >= step_event_count) {
+      step_events_prepared = true;
+      return;
+    }
+  }
+}
+
+// Pulses the step pins of the next queued step event and loads the timer with its interval
+FORCE_INLINE void output_step_event() {
+  volatile step_event_t *event = &step_events[step_event_tail];
+  OCR1A = event->interval;
+  #ifdef SPREAD_MULTI_STEPS
+    output_steps(event->bits, event->step_interval);
+  #else
+    output_steps(event->bits, 0);
+  #endif
+  step_event_tail = (step_event_tail + 1) & (STEP_EVENT_QUEUE_SIZE - 1);
+}
+#endif //STEP_EVENT_QUEUE
+
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.  
 // It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately. 
 ISR(TIMER1_COMPA_vect)
 {    
+  #ifdef SPREAD_MULTI_STEPS
+    flush_spread_steps();
+  #endif
+  #ifdef STEP_EVENT_QUEUE
+    // The current block is done once the last of its step events has been output
+    if ((current_block != NULL) && step_events_prepared && (step_event_head == step_event_tail)) {
+      current_block = NULL;
+      plan_discard_current_block();
+    }
+  #endif
+
   // If there is no current block, attempt to pop one from the buffer
   if (current_block == NULL) {
     // Anything in the buffer?
     current_block = plan_get_current_block();
-    if (current_block != NULL) {
+    if ((current_block != NULL) && (current_block->step_event_count == 0)) {
+      // A dwell (G4), counted down below without touching the step or endstop state
       current_block->busy = true;
+      dwell_left_us = current_block->segment_time_us;
+      endstops_to_check = 0;
+      #ifdef STEP_EVENT_QUEUE
+        step_events_prepared = false; // Keeps the block from being discarded above
+      #endif
+    }
+    else if (current_block != NULL) {
+      current_block->busy = true;
+      #ifdef STEP_EVENT_QUEUE
+        step_events_prepared = false;
+        step_events_abort = false;
+      #endif
+      set_directions();
       trapezoid_generator_reset();
+      // Half a step, not half the oversampled step events: the fastest axis then steps in the first part of its
+      // step at every oversampling, so its steps keep their spacing when the oversampling changes
       counter_x = -(current_block->step_event_count >> 1);
       counter_y = counter_x;
       counter_z = counter_x;
       counter_e = counter_x;
-      step_events_completed = 0; 
+      #ifdef ENDSTOP_INTERRUPTS
+        endstops_changed(); // A switch that is already closed doesn't cause an interrupt
+      #endif
       
       #ifdef Z_LATE_ENABLE 
         if(current_block->steps_z > 0) {
@@ -315,243 +852,123 @@ ISR(TIMER1_COMPA_vect)
     }    
   } 
 
-  if (current_block != NULL) {
-    // Set directions TO DO This should be done once during init of trapezoid. Endstops -> interrupt
-    out_bits = current_block->direction_bits;
-
-    // Set direction en check limit switches
-    if ((out_bits & (1<<X_AXIS)) != 0) {   // -direction
-      WRITE(X_DIR_PIN, INVERT_X_DIR);
-      count_direction[X_AXIS]=-1;
-      CHECK_ENDSTOPS
-      {
-        #if X_MIN_PIN > -1
-          bool x_min_endstop=(READ(X_MIN_PIN) != X_ENDSTOPS_INVERTING);
-          if(x_min_endstop && old_x_min_endstop && (current_block->steps_x > 0)) {
-            endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-            endstop_x_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_x_min_endstop = x_min_endstop;
-        #endif
-      }
-    }
-    else { // +direction 
-      WRITE(X_DIR_PIN,!INVERT_X_DIR);
-      count_direction[X_AXIS]=1;
-      CHECK_ENDSTOPS 
-      {
-        #if X_MAX_PIN > -1
-          bool x_max_endstop=(READ(X_MAX_PIN) != X_ENDSTOPS_INVERTING);
-          if(x_max_endstop && old_x_max_endstop && (current_block->steps_x > 0)){
-            endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-            endstop_x_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_x_max_endstop = x_max_endstop;
-        #endif
-      }
-    }
-
-    if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
-      WRITE(Y_DIR_PIN,INVERT_Y_DIR);
-      count_direction[Y_AXIS]=-1;
-      CHECK_ENDSTOPS
-      {
-        #if Y_MIN_PIN > -1
-          bool y_min_endstop=(READ(Y_MIN_PIN) != Y_ENDSTOPS_INVERTING);
-          if(y_min_endstop && old_y_min_endstop && (current_block->steps_y > 0)) {
-            endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-            endstop_y_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_y_min_endstop = y_min_endstop;
-        #endif
-      }
-    }
-    else { // +direction
-    WRITE(Y_DIR_PIN,!INVERT_Y_DIR);
-      count_direction[Y_AXIS]=1;
-      CHECK_ENDSTOPS
-      {
-        #if Y_MAX_PIN > -1
-          bool y_max_endstop=(READ(Y_MAX_PIN) != Y_ENDSTOPS_INVERTING);
-          if(y_max_endstop && old_y_max_endstop && (current_block->steps_y > 0)){
-            endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-            endstop_y_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_y_max_endstop = y_max_endstop;
-        #endif
-      }
-    }
-
-    if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
-      WRITE(Z_DIR_PIN,INVERT_Z_DIR);
-      count_direction[Z_AXIS]=-1;
-      CHECK_ENDSTOPS
-      {
-        #if Z_MIN_PIN > -1
-          bool z_min_endstop=(READ(Z_MIN_PIN) != Z_ENDSTOPS_INVERTING);
-          if(z_min_endstop && old_z_min_endstop && (current_block->steps_z > 0)) {
-            endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-            endstop_z_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_z_min_endstop = z_min_endstop;
-        #endif
-      }
+  if ((current_block != NULL) && (current_block->step_event_count == 0)) {
+    // Wait in intervals the timer can hold, then go on with the next block
+    if (dwell_left_us == 0) {
+      current_block = NULL;
+      plan_discard_current_block();
+      OCR1A = 100;
     }
-    else { // +direction
-      WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
-      count_direction[Z_AXIS]=1;
-      CHECK_ENDSTOPS
-      {
-        #if Z_MAX_PIN > -1
-          bool z_max_endstop=(READ(Z_MAX_PIN) != Z_ENDSTOPS_INVERTING);
-          if(z_max_endstop && old_z_max_endstop && (current_block->steps_z > 0)) {
-            endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-            endstop_z_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_z_max_endstop = z_max_endstop;
-        #endif
-      }
+    else {
+      unsigned long wait_us = min(dwell_left_us, 30000UL); // 60000 timer ticks
+      dwell_left_us -= wait_us;
+      OCR1A = max(wait_us*(F_CPU/8000000), 100UL);
     }
-
-    #ifndef ADVANCE
-      if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
-        REV_E_DIR();
-        count_direction[E_AXIS]=-1;
-      }
-      else { // +direction
-        NORM_E_DIR();
-        count_direction[E_AXIS]=1;
+  }
+  else if (current_block != NULL) {
+    #ifndef ENDSTOP_INTERRUPTS
+    CHECK_ENDSTOPS
+    {
+      // Only the switches the block moves towards are read, see set_directions()
+      #if X_MIN_PIN > -1
+      if(endstops_to_check & ENDSTOP_X_MIN) {
+        bool x_min_endstop=(READ(X_MIN_PIN) != X_ENDSTOPS_INVERTING);
+        if(x_min_endstop && old_x_min_endstop) {
+          endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+          endstop_x_hit=true;
+          end_current_block();
+        }
+        old_x_min_endstop = x_min_endstop;
       }
-    #endif //!ADVANCE
-    
-
-    
-    for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
-      #ifndef REPRAPPRO_MULTIMATERIALS
-      #if MOTHERBOARD != 8 // !teensylu
-      MSerial.checkRx(); // Check for serial chars.
-      #endif 
       #endif
-      
-      #ifdef ADVANCE
-      counter_e += current_block->steps_e;
-      if (counter_e > 0) {
-        counter_e -= current_block->step_event_count;
-        if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
-          e_steps[current_block->active_extruder]--;
+      #if X_MAX_PIN > -1
+      if(endstops_to_check & ENDSTOP_X_MAX) {
+        bool x_max_endstop=(READ(X_MAX_PIN) != X_ENDSTOPS_INVERTING);
+        if(x_max_endstop && old_x_max_endstop){
+          endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+          endstop_x_hit=true;
+          end_current_block();
         }
-        else {
-          e_steps[current_block->active_extruder]++;
+        old_x_max_endstop = x_max_endstop;
+      }
+      #endif
+      #if Y_MIN_PIN > -1
+      if(endstops_to_check & ENDSTOP_Y_MIN) {
+        bool y_min_endstop=(READ(Y_MIN_PIN) != Y_ENDSTOPS_INVERTING);
+        if(y_min_endstop && old_y_min_endstop) {
+          endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+          endstop_y_hit=true;
+          end_current_block();
         }
-      }    
-      #endif //ADVANCE
-      
-      counter_x += current_block->steps_x;
-      if (counter_x > 0) {
-        WRITE(X_STEP_PIN, HIGH);
-        counter_x -= current_block->step_event_count;
-        WRITE(X_STEP_PIN, LOW);
-        count_position[X_AXIS]+=count_direction[X_AXIS];   
+        old_y_min_endstop = y_min_endstop;
       }
-
-      counter_y += current_block->steps_y;
-      if (counter_y > 0) {
-        WRITE(Y_STEP_PIN, HIGH);
-        counter_y -= current_block->step_event_count;
-        WRITE(Y_STEP_PIN, LOW);
-        count_position[Y_AXIS]+=count_direction[Y_AXIS];
+      #endif
+      #if Y_MAX_PIN > -1
+      if(endstops_to_check & ENDSTOP_Y_MAX) {
+        bool y_max_endstop=(READ(Y_MAX_PIN) != Y_ENDSTOPS_INVERTING);
+        if(y_max_endstop && old_y_max_endstop){
+          endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+          endstop_y_hit=true;
+          end_current_block();
+        }
+        old_y_max_endstop = y_max_endstop;
       }
-
-      counter_z += current_block->steps_z;
-      if (counter_z > 0) {
-        WRITE(Z_STEP_PIN, HIGH);
-        counter_z -= current_block->step_event_count;
-        WRITE(Z_STEP_PIN, LOW);
-        count_position[Z_AXIS]+=count_direction[Z_AXIS];
+      #endif
+      #if Z_MIN_PIN > -1
+      if(endstops_to_check & ENDSTOP_Z_MIN) {
+        bool z_min_endstop=(READ(Z_MIN_PIN) != Z_ENDSTOPS_INVERTING);
+        if(z_min_endstop && old_z_min_endstop) {
+          endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+          endstop_z_hit=true;
+          end_current_block();
+        }
+        old_z_min_endstop = z_min_endstop;
       }
-
-      #ifndef ADVANCE
-        counter_e += current_block->steps_e;
-        if (counter_e > 0) {
-          WRITE_E_STEP(HIGH);
-          counter_e -= current_block->step_event_count;
-          WRITE_E_STEP(LOW);
-          count_position[E_AXIS]+=count_direction[E_AXIS];
+      #endif
+      #if Z_MAX_PIN > -1
+      if(endstops_to_check & ENDSTOP_Z_MAX) {
+        bool z_max_endstop=(READ(Z_MAX_PIN) != Z_ENDSTOPS_INVERTING);
+        if(z_max_endstop && old_z_max_endstop) {
+          endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+          endstop_z_hit=true;
+          end_current_block();
         }
-      #endif //!ADVANCE
-      step_events_completed += 1;  
-      if(step_events_completed >= current_block->step_event_count) break;
+        old_z_max_endstop = z_max_endstop;
+      }
+      #endif
     }
-    // Calculare new timer value
-    unsigned short timer;
-    unsigned short step_rate;
-    if (step_events_completed <= (unsigned long int)current_block->accelerate_until) {
-      
-      MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
-      acc_step_rate += current_block->initial_rate;
-      
-      // upper limit
-      if(acc_step_rate > current_block->nominal_rate)
-        acc_step_rate = current_block->nominal_rate;
+    #endif //!ENDSTOP_INTERRUPTS
 
-      // step_rate to timer interval
-      timer = calc_timer(acc_step_rate);
-      OCR1A = timer;
-      acceleration_time += timer;
-      #ifdef ADVANCE
-        for(int8_t i=0; i < step_loops; i++) {
-          advance += advance_rate;
-        }
-        //if(advance > current_block->advance) advance = current_block->advance;
-        // Do E steps + advance steps
-        e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
-        old_advance = advance >>8;  
-        
-      #endif
-    } 
-    else if (step_events_completed > (unsigned long int)current_block->decelerate_after) {   
-      MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
-      
-      if(step_rate > acc_step_rate) { // Check step_rate stays positive
-        step_rate = current_block->final_rate;
+    #ifdef STEP_EVENT_QUEUE
+      if ((step_event_head == step_event_tail) && !step_events_filling) {
+        prepare_step_events(1); // The first step of a block
+      }
+      if (step_event_head != step_event_tail) {
+        output_step_event();
       }
       else {
-        step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+        OCR1A = 100; // The refill fell behind, or the block has ended
       }
-
-      // lower limit
-      if(step_rate < current_block->final_rate)
-        step_rate = current_block->final_rate;
-
-      // step_rate to timer interval
-      timer = calc_timer(step_rate);
+      // Refill the queue with interrupts enabled, this interrupt outputs the next step events meanwhile
+      if (!step_events_filling && (step_events_free() >= STEP_EVENT_QUEUE_SIZE/2)) {
+        step_events_filling = true;
+        sei();
+        prepare_step_events(STEP_EVENT_QUEUE_SIZE);
+        cli();
+        step_events_filling = false;
+      }
+    #else
+      // The interval first, it sets how many steps this interrupt takes
+      unsigned short timer = next_step_interval();
       OCR1A = timer;
-      deceleration_time += timer;
-      #ifdef ADVANCE
-        for(int8_t i=0; i < step_loops; i++) {
-          advance -= advance_rate;
-        }
-        if(advance < final_advance) advance = final_advance;
-        // Do E steps + advance steps
-        e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
-        old_advance = advance >>8;  
-      #endif //ADVANCE
-    }
-    else {
-      OCR1A = OCR1A_nominal;
-    }
+      output_steps(trace_step_loops(), step_loop_interval(timer));
 
-    // If current block is finished, reset pointer 
-    if (step_events_completed >= current_block->step_event_count) {
-      current_block = NULL;
-      plan_discard_current_block();
-    }   
+      // If current block is finished, reset pointer 
+      if (step_events_completed >= step_event_count) {
+        current_block = NULL;
+        plan_discard_current_block();
+      }   
+    #endif //STEP_EVENT_QUEUE
   } 
 }
 
@@ -707,6 +1124,27 @@ void st_init()
       SET_INPUT(Z_MAX_PIN); 
     #endif
   #endif //ENDSTOPPULLUPS
+
+  #ifdef ENDSTOP_INTERRUPTS
+    #if X_MIN_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(X_MIN_PIN);
+    #endif
+    #if X_MAX_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(X_MAX_PIN);
+    #endif
+    #if Y_MIN_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(Y_MIN_PIN);
+    #endif
+    #if Y_MAX_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(Y_MAX_PIN);
+    #endif
+    #if Z_MIN_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(Z_MIN_PIN);
+    #endif
+    #if Z_MAX_PIN > -1
+      ENABLE_ENDSTOP_INTERRUPT(Z_MAX_PIN);
+    #endif
+  #endif //ENDSTOP_INTERRUPTS
  
 
   //Initialize Step Pins
@@ -847,6 +1285,12 @@ void quickStop()
   while(blocks_queued())
     plan_discard_current_block();
   current_block = NULL;
+  #ifdef STEP_EVENT_QUEUE
+    step_event_tail = step_event_head;
+  #endif
+  #ifdef SPREAD_MULTI_STEPS
+    spread_bits = 0;
+  #endif
   ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
 
@@ -0,0 +1,249 @@
+// Runs the binary protocol of BINARY_PROTOCOL (M530) of Marlin.ino on the host and has binary_gcode.py send
+// g-code to it over a pseudo terminal, as it would to the printer. The received bytes go through rx_buffer to
+// get_command(), get_binary_frames(), check_frame(), queue_binary_move() and queue_command(), and every queued
+// command is compared with its line of the g-code through code_seen() and code_value(). Moves are acknowledged
+// when they are queued, other commands by ClearToSend() once they are compared; only M530 is executed.
+//
+// ERROR_RATE of the bytes received in binary mode are damaged or lost, so the resends are exercised as well.
+// Fails if a command differs from its line, one is missing or repeated, or binary_gcode.py fails.
+//
+// Without a file the lines are generated: moves with X and Y to 3 decimals and E to 5 that are sent as moves,
+// moves with more decimals that are sent as text, and other commands, comments and blank lines between them.
+//
+//   make binary_frames && ./binary_frames [print.gcode]
+#include <ctype.h> // Before host.h, which redefines long
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "host.h"
+#undef SDSUPPORT // The SD card needs SdFat and can't be written to in binary mode anyway
+#include "Marlin.ino"
+#include "parse_number.cpp"
+#include "planner.cpp"
+#include "stepper.cpp"
+#include "motion_control.cpp"
+#include "MatrixMath.cpp"
+#include "FPUTransform.cpp"
+
+#define BINARY_GCODE_PY "../binary_gcode.py"
+#define ERROR_RATE 0.002
+#define MAX_LINES 20000
+#define MAX_LINE_LENGTH 96
+#define GENERATED_LINES 5000
+#define MAX_REPORTS 10 // Commands that differ told about
+
+// What Marlin.ino uses from temperature.cpp, led.cpp and the AVR's C library
+int target_raw[EXTRUDERS_T], heatingtarget_raw[EXTRUDERS_T], current_raw[EXTRUDERS_T];
+int target_raw_bed, current_raw_bed;
+int b_beta, b_resistor, n_beta, n_resistor;
+long b_thermistor, n_thermistor;
+float b_inf, n_inf;
+float Kp, Ki, Kd;
+int Ki_Max;
+float pid_setpoint[EXTRUDERS_T];
+void tp_init() {}
+void manage_heater() {}
+void disable_heater() {}
+void updatePID() {}
+void PID_autotune(float temp) {}
+int getHeaterPower(int heater) { return 0; }
+float analog2temp(int raw, uint8_t e) { return 210; }
+float analog2tempBed(int raw) { return 60; }
+int temp2analog(int celsius, uint8_t e) { return 0; }
+int temp2analogBed(int celsius) { return 0; }
+void led_init() {}
+void led_status() {}
+extern "C" {
+  unsigned int __bss_end;
+  unsigned int __heap_start;
+  void *__brkval;
+}
+
+// The commands of the g-code, without comments, in the order the firmware has to queue them
+static char lines[MAX_LINES][MAX_LINE_LENGTH];
+static int line_count;
+
+static void add_line(const char *line) {
+  if(line_count < MAX_LINES) snprintf(lines[line_count++], MAX_LINE_LENGTH, "%s", line);
+}
+
+// Reads the commands of a g-code file as binary_gcode.py sends them, without comments and blank lines
+static bool read_lines(const char *name) {
+  FILE *file = fopen(name, "r");
+  if(file == NULL) return false;
+  char text[256];
+  while(fgets(text, sizeof(text), file) != NULL) {
+    char *comment = strchr(text, ';');
+    if(comment != NULL) *comment = 0;
+    char *start = text;
+    while(isspace(*start)) start++;
+    int length = strlen(start);
+    while(length > 0 && isspace(start[length - 1])) length--;
+    start[length] = 0;
+    if(length > 0) add_line(start);
+  }
+  fclose(file);
+  return true;
+}
+
+// A print with the commands of a sliced model, written to name for binary_gcode.py
+static bool generate_lines(const char *name) {
+  FILE *file = fopen(name, "w");
+  if(file == NULL) return false;
+  const char *start[] = { "G28", "M104 S200", "G92 E0", "G1 F1800", "M117 Printing model.gcode" };
+  for(unsigned char i = 0; i < sizeof(start)/sizeof(start[0]); i++) fprintf(file, "%s\n", start[i]);
+  float x = 100, y = 100, e = 0;
+  for(int n = 0; n < GENERATED_LINES; n++) {
+    double choice = host_random_range(0, 1);
+    if(choice < 0.02)
+      fprintf(file, "M106 S%d\n", (int)host_random_range(0, 256));
+    else if(choice < 0.04)
+      fprintf(file, "G1 Z%.2f F600 ; layer change\n\n", host_random_range(0.2, 100));
+    else if(choice < 0.06)
+      fprintf(file, "G0 X%.3f Y%.3f F9000\n", host_random_range(0, 200), host_random_range(0, 200));
+    else if(choice < 0.07)
+      fprintf(file, "G1 X%.6f Y%.6f\n", host_random_range(0, 200), host_random_range(0, 200));
+    else if(choice < 0.08)
+      fprintf(file, "G92 E0\n");
+    else {
+      x = min(200.0, max(0.0, x + host_random_range(-5, 5)));
+      y = min(200.0, max(0.0, y + host_random_range(-5, 5)));
+      e += host_random_range(0, 0.3);
+      fprintf(file, "G1 X%.3f Y%.3f E%.5f\n", x, y, e);
+    }
+  }
+  fprintf(file, "M104 S0\n");
+  fclose(file);
+  return true;
+}
+
+// Compares the command process_commands() would execute now with line, as queue_command() reads it: the first
+// G, M or T followed by a digit is the code, the first occurrence of every other capital letter but N is a
+// parameter. Returns false and tells what differs for the first MAX_REPORTS that don't match.
+static int reports;
+
+static bool compare_command(int index, const char *line) {
+  char code = 0;
+  const char *seen[26] = { NULL };
+  for(const char *c = line; *c != 0; c++) {
+    if(*c < 'A' || *c > 'Z' || *c == 'N') continue;
+    if(code == 0 && (*c == 'G' || *c == 'M' || *c == 'T') && isdigit(c[1])) {
+      code = *c;
+      continue;
+    }
+    if(seen[*c - 'A'] == NULL) seen[*c - 'A'] = c + 1;
+  }
+  if(code != 0 && (!code_seen(code) || (int)code_value() != atoi(strchr(line, code) + 1))) {
+    if(reports++ < MAX_REPORTS) {
+      printf("command %d: %c%d instead of \"%s\"\n", index, code, code_seen(code) ? (int)code_value() : -1, line);
+    }
+    return false;
+  }
+  for(char letter = 'A'; letter <= 'Z'; letter++) {
+    if(letter == 'N' || letter == code) continue;
+    const char *expected = seen[letter - 'A'];
+    if(code_seen(letter) != (expected != NULL)) {
+      if(reports++ < MAX_REPORTS) printf("command %d: %c %s in \"%s\"\n", index, letter, expected ? "missing" : "seen", line);
+      return false;
+    }
+    if(expected == NULL) continue;
+    // Moves are sent in 1/1000 mm and 1/100000 mm of E and text is parsed to within an ulp of strtod()
+    float value = code_value();
+    float wanted = strtod(expected, NULL);
+    if(fabs(value - wanted) > fabs(wanted)*2.5e-7 + 1e-9) {
+      if(reports++ < MAX_REPORTS) printf("command %d: %c%.9g instead of \"%s\"\n", index, letter, value, line);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The commands the firmware has queued, compared in the order they arrived. Returns the number that differ.
+static int run_commands(int &next_line) {
+  int wrong = 0;
+  while(buflen) {
+    if(CMD_QUEUE_SIZE - cmd_queue_tail < sizeof(cmd_header_t) ||
+       ((cmd_header_t *)&cmd_queue[cmd_queue_tail])->command == CMD_END)
+      cmd_queue_tail = 0;
+    current_cmd = (cmd_header_t *)&cmd_queue[cmd_queue_tail];
+    unsigned char size = command_size(current_cmd);
+    // M530 S1 comes first and M530 S0 last, binary_gcode.py adds them
+    const char *line = (next_line == 0) ? "M530 S1" : (next_line <= line_count) ? lines[next_line - 1] : "M530 S0";
+    if(next_line > line_count + 1) line = "nothing";
+    if(!compare_command(next_line, line)) wrong++;
+    next_line++;
+    if(command_code(current_cmd) == 'M' && command_number(current_cmd) == 530)
+      process_commands();
+    else if(command_code(current_cmd) != 'G' || command_number(current_cmd) > 3)
+      ClearToSend();
+    cmd_queue_tail += size;
+    buflen--;
+    current_cmd = NULL;
+  }
+  return wrong;
+}
+
+int main(int argc, char **argv) {
+  char generated[] = "/tmp/binary_frames_XXXXXX";
+  const char *gcode = argv[1];
+  if(argc < 2) {
+    int fd = mkstemp(generated);
+    if(fd < 0 || !generate_lines(generated)) { perror(generated); return 2; }
+    close(fd);
+    gcode = generated;
+  }
+  if(!read_lines(gcode)) { perror(gcode); return 2; }
+
+  // The firmware talks on the master side of the pseudo terminal, binary_gcode.py on the slave
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) { perror("posix_openpt"); return 2; }
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  host_serial_out = fdopen(dup(master), "w");
+  pid_t sender = fork();
+  if(sender == 0) {
+    execlp("python3", "python3", BINARY_GCODE_PY, "--port", ptsname(master), "--timeout", "0.5", gcode, (char *)NULL);
+    perror(BINARY_GCODE_PY);
+    _exit(2);
+  }
+  fflush(stdout);
+
+  int next_line = 0, wrong = 0, damaged = 0, status = 0;
+  unsigned char received[256];
+  int received_count = 0, received_used = 0;
+  for(;;) {
+    // The receive interrupt: bytes are taken while rx_buffer has room for them
+    if(received_used == received_count) {
+      struct pollfd fds = { master, POLLIN, 0 };
+      received_used = received_count = 0;
+      if(poll(&fds, 1, buflen || line_pending ? 0 : 10) > 0) {
+        int count = read(master, received, sizeof(received));
+        if(count > 0) received_count = count;
+      }
+      if(received_count == 0 && waitpid(sender, &status, WNOHANG) == sender) break;
+    }
+    while(received_used < received_count &&
+          ((rx_buffer.head + 1) & (RX_BUFFER_SIZE - 1)) != rx_buffer.tail) {
+      unsigned char c = received[received_used++];
+      if(binary_mode && host_random_range(0, 1) < ERROR_RATE) {
+        damaged++;
+        if(host_random() & 1) continue;
+        c ^= 1 << (host_random() & 7);
+      }
+      rx_buffer.buffer[rx_buffer.head] = c;
+      rx_buffer.head = (rx_buffer.head + 1) & (RX_BUFFER_SIZE - 1);
+    }
+    get_command();
+    wrong += run_commands(next_line);
+    fflush(host_serial_out);
+  }
+
+  if(argc < 2) unlink(generated);
+  int missing = line_count + 2 - next_line;
+  printf("%d lines, %d bytes damaged or lost, %u checksum errors, %u frames missing, %u resends requested\n",
+    line_count, damaged, checksum_errors, line_number_errors, resend_requests);
+  printf("%d commands differ from their line, %d missing\n", wrong, missing);
+  bool failed = wrong != 0 || missing != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  printf(failed ? "FAILED\n" : "passed\n");
+  return failed;
+}
@@ -0,0 +1,125 @@
+// Runs parts of the firmware on the host for the benchmarks and simulations in this directory. Each test program
+// is a single translation unit: it includes this file once, then the firmware sources it exercises, then defines
+// the firmware functions it doesn't include (manage_heater() and the like) itself.
+//
+// The registers are plain variables and the interrupt handlers ordinary functions, see shim/. The AVR's long is
+// 32 bits wide, so long is redefined to int for everything after Marlin.h: the firmware's unsigned long math
+// overflows and rounds as it does on the printer. int stays 32 bits wide, where it is 16 bits on the AVR.
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+
+#include "Marlin.h"
+
+//===========================================================================
+//=============================host registers ===============================
+//===========================================================================
+volatile uint8_t PINA, PORTA, DDRA, PINB, PORTB, DDRB, PINC, PORTC, DDRC, PIND, PORTD, DDRD;
+volatile uint8_t SREG = 0x80;
+volatile uint8_t TCCR0A, TCCR0B, TIMSK0, TIFR0, OCR0A, OCR0B, TCNT0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, OCR1B, TCNT1;
+volatile uint8_t TCCR2A, TCCR2B, OCR2A, OCR2B;
+volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2, PCMSK3;
+volatile uint8_t UBRR0H, UBRR0L, UCSR0A = (1<<UDRE0), UCSR0B, UDR0;
+volatile uint8_t MCUSR;
+
+//===========================================================================
+//=============================host arduino core ============================
+//===========================================================================
+unsigned long host_millis; // What millis() returns, the test programs advance it
+unsigned long millis(void) { return host_millis; }
+unsigned long micros(void) { return host_millis*1000; }
+void delay(unsigned long ms) { host_millis += ms; }
+void delayMicroseconds(unsigned int) {}
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return 0; }
+int analogRead(uint8_t) { return 0; }
+void analogWrite(uint8_t, int) {}
+
+//===========================================================================
+//=============================host serial ==================================
+//===========================================================================
+// Serial output goes to host_serial_out, stdout unless a test program changes it, unless host_serial_quiet is
+// set. Received bytes are read from rx_buffer, where the test programs store them as the receive interrupt does.
+bool host_serial_quiet = false;
+FILE *host_serial_out = stdout;
+ring_buffer rx_buffer;
+#ifdef TX_BUFFER_SIZE
+tx_ring_buffer tx_buffer;
+void MarlinSerial::write(uint8_t c) { if(!host_serial_quiet) putc(c, host_serial_out); }
+#endif
+MarlinSerial::MarlinSerial() {}
+MarlinSerial MSerial;
+void MarlinSerial::begin(long) {}
+void MarlinSerial::end() {}
+int MarlinSerial::peek(void) {
+  if(rx_buffer.head == rx_buffer.tail) return -1;
+  return rx_buffer.buffer[rx_buffer.tail];
+}
+int MarlinSerial::read(void) {
+  if(rx_buffer.head == rx_buffer.tail) return -1;
+  unsigned char c = rx_buffer.buffer[rx_buffer.tail];
+  rx_buffer.tail = (rx_buffer.tail + 1) & (RX_BUFFER_SIZE - 1);
+  return c;
+}
+void MarlinSerial::flush(void) { rx_buffer.tail = rx_buffer.head; }
+void MarlinSerial::print(char c, int) { if(!host_serial_quiet) putc(c, host_serial_out); }
+void MarlinSerial::print(unsigned char c, int) { if(!host_serial_quiet) putc(c, host_serial_out); }
+void MarlinSerial::print(int n, int) { if(!host_serial_quiet) fprintf(host_serial_out, "%d", n); }
+void MarlinSerial::print(unsigned int n, int) { if(!host_serial_quiet) fprintf(host_serial_out, "%u", n); }
+void MarlinSerial::print(long n, int) { if(!host_serial_quiet) fprintf(host_serial_out, "%ld", n); }
+void MarlinSerial::print(unsigned long n, int) { if(!host_serial_quiet) fprintf(host_serial_out, "%lu", n); }
+void MarlinSerial::print(double n, int digits) { if(!host_serial_quiet) fprintf(host_serial_out, "%.*f", digits, n); }
+void MarlinSerial::println(const String &s) { print(s); println(); }
+void MarlinSerial::println(const char c[]) { print(c); println(); }
+void MarlinSerial::println(char c, int base) { print(c, base); println(); }
+void MarlinSerial::println(unsigned char c, int base) { print(c, base); println(); }
+void MarlinSerial::println(int n, int base) { print(n, base); println(); }
+void MarlinSerial::println(unsigned int n, int base) { print(n, base); println(); }
+void MarlinSerial::println(long n, int base) { print(n, base); println(); }
+void MarlinSerial::println(unsigned long n, int base) { print(n, base); println(); }
+void MarlinSerial::println(double n, int digits) { print(n, digits); println(); }
+void MarlinSerial::println(void) { if(!host_serial_quiet) putc('\n', host_serial_out); }
+
+//===========================================================================
+//=============================host timing ==================================
+//===========================================================================
+// Host processor cycles, or nanoseconds where there is no cycle counter
+FORCE_INLINE uint64_t host_cycles() {
+  #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+  #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+  #endif
+}
+
+// Deterministic pseudo random numbers, so every run sees the same test cases
+uint32_t host_random_state = 12345;
+uint32_t host_random() {
+  host_random_state ^= host_random_state << 13;
+  host_random_state ^= host_random_state >> 17;
+  host_random_state ^= host_random_state << 5;
+  return host_random_state;
+}
+// Uniform in [low, high)
+double host_random_range(double low, double high) {
+  return low + (high - low)*(host_random() / 4294967296.0);
+}
+
+#define long int
+
+#endif // HOST_H
@@ -0,0 +1,196 @@
+// Host benchmark of parse_float() and parse_long() against the strtod() and strtol() they replace, over the
+// parameters of the lines a host sends: line number, command, parameters and checksum. Reports the host cycles per
+// parameter and how many values differ.
+//
+// Without a file the lines are generated in the format of Slic3r: moves with X and Y to 3 decimals, E to 5,
+// feed rates, layer changes, retractions and fan and temperature commands. Give it the g-code of a real print to
+// measure that instead; comments and blank lines are skipped and line numbers and checksums added as a host does.
+//
+// Every pass is timed REPEATS times and the fastest time counts. The AVR's strtod() does its scaling in soft
+// float per digit, so the difference on the printer is larger than here.
+//
+//   make parse_bench && ./parse_bench [print.gcode]
+#include "host.h"
+#include "parse_number.cpp"
+
+#define MAX_LINES 200000
+#define MAX_LINE_LENGTH 96
+#define REPEATS 7
+
+static char lines[MAX_LINES][MAX_LINE_LENGTH];
+static int line_count;
+static const char *float_params[MAX_LINES*8]; // After the letter of each parameter
+static int float_param_count;
+static const char *long_params[MAX_LINES*2];  // The line numbers and checksums
+static int long_param_count;
+
+// Numbers the command and adds its checksum, as a host sends it
+static void add_line(const char *command) {
+  if(line_count == MAX_LINES) return;
+  char *line = lines[line_count];
+  int length = snprintf(line, MAX_LINE_LENGTH - 4, "N%d %s", line_count + 1, command);
+  unsigned char checksum = 0;
+  for(int i = 0; i < length; i++) checksum ^= line[i];
+  snprintf(line + length, 5, "*%d", checksum);
+  line_count++;
+}
+
+// A sliced model in the format of Slic3r
+static void generate_lines() {
+  char command[MAX_LINE_LENGTH];
+  add_line("M107");
+  add_line("M104 S205");
+  add_line("G28");
+  add_line("G21");
+  add_line("G90");
+  add_line("M82");
+  add_line("G92 E0");
+  float z = 0;
+  float angle = 0;
+  float x = 100, y = 100;
+  for(int layer = 0; line_count < MAX_LINES - 100; layer++) {
+    z += (layer == 0) ? 0.35 : 0.25;
+    snprintf(command, sizeof(command), "G1 Z%.3f F7800.000", z);
+    add_line(command);
+    if(layer == 1) add_line("M106 S255");
+    if(layer == 2) add_line("M104 S200");
+    add_line("G1 E2.00000 F2400.00000");
+    add_line("G92 E0");
+    float e = 0;
+    // Perimeters of 0.3..1 mm chords, then a zigzag infill
+    for(int i = 0; i < 600; i++) {
+      float radius = 20 + 10*sin(layer*0.05 + i*0.001);
+      angle += host_random_range(0.3, 1.0) / radius;
+      float new_x = 100 + 1.5*radius*cos(angle);
+      float new_y = 100 + radius*sin(angle);
+      e += 0.0465*sqrt(square(new_x - x) + square(new_y - y));
+      x = new_x;
+      y = new_y;
+      if(i == 0) snprintf(command, sizeof(command), "G1 X%.3f Y%.3f E%.5f F1800.000", x, y, e);
+      else snprintf(command, sizeof(command), "G1 X%.3f Y%.3f E%.5f", x, y, e);
+      add_line(command);
+    }
+    for(int i = 0; i < 120; i++) {
+      x = (i & 1) ? 130 + host_random_range(0, 0.5) : 70 - host_random_range(0, 0.5);
+      y = 80 + i*0.35;
+      e += 0.0465*60;
+      if(i == 0) snprintf(command, sizeof(command), "G1 X%.3f Y%.3f E%.5f F3600.000", x, y, e);
+      else snprintf(command, sizeof(command), "G1 X%.3f Y%.3f E%.5f", x, y, e);
+      add_line(command);
+    }
+    snprintf(command, sizeof(command), "G1 E%.5f F2400.00000", e - 2);
+    add_line(command);
+    add_line("G92 E0");
+  }
+  add_line("M104 S0");
+  add_line("G28 X0");
+  add_line("M84");
+}
+
+// Reads the commands of a g-code file, without comments and blank lines
+static bool read_lines(const char *name) {
+  FILE *file = fopen(name, "r");
+  if(file == NULL) return false;
+  char text[256];
+  while(fgets(text, sizeof(text), file) != NULL) {
+    char *comment = strchr(text, ';');
+    if(comment != NULL) *comment = 0;
+    int length = strlen(text);
+    while(length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r' || text[length - 1] == ' ')) length--;
+    text[length] = 0;
+    if(length > 0 && length < MAX_LINE_LENGTH - 16) add_line(text);
+  }
+  fclose(file);
+  return true;
+}
+
+// Finds the numbers after the letters of every line, as parse_command() does
+static void find_params() {
+  for(int l = 0; l < line_count; l++) {
+    const char *line = lines[l];
+    for(int i = 0; line[i] != 0; i++) {
+      char c = line[i];
+      if(c == 'N' || c == '*') long_params[long_param_count++] = &line[i + 1];
+      else if(c >= 'A' && c <= 'Z') float_params[float_param_count++] = &line[i + 1];
+    }
+  }
+}
+
+// Counts the parameters parse_float() reads differently from strtod() and finds the largest difference, in units
+// in the last place of the float
+static int compare_floats(int &worst_ulps) {
+  int wrong = 0;
+  worst_ulps = 0;
+  for(int i = 0; i < float_param_count; i++) {
+    float value = parse_float(float_params[i]);
+    float expected = strtod(float_params[i], NULL);
+    if(value == expected) continue;
+    int32_t value_bits, expected_bits;
+    memcpy(&value_bits, &value, sizeof(value));
+    memcpy(&expected_bits, &expected, sizeof(expected));
+    int ulps = abs(value_bits - expected_bits);
+    if(ulps > worst_ulps) worst_ulps = ulps;
+    if(wrong++ < 3) printf("%.*s read as %.9g instead of %.9g\n", (int)strcspn(float_params[i], " *"),
+      float_params[i], value, expected);
+  }
+  return wrong;
+}
+
+static float parse_float_strtod(const char *str) { return strtod(str, NULL); }
+static long parse_long_strtol(const char *str) { return strtol(str, NULL, 10); }
+
+// Fastest host cycles per parameter of REPEATS passes
+static double time_floats(float (*parse)(const char *)) {
+  volatile float sink;
+  uint64_t best = ~(uint64_t)0;
+  for(int r = 0; r < REPEATS; r++) {
+    float sum = 0;
+    uint64_t start = host_cycles();
+    for(int i = 0; i < float_param_count; i++) sum += parse(float_params[i]);
+    uint64_t cycles = host_cycles() - start;
+    sink = sum;
+    if(cycles < best) best = cycles;
+  }
+  return (double)best/float_param_count;
+}
+
+static double time_longs(long (*parse)(const char *)) {
+  volatile long sink;
+  uint64_t best = ~(uint64_t)0;
+  for(int r = 0; r < REPEATS; r++) {
+    long sum = 0;
+    uint64_t start = host_cycles();
+    for(int i = 0; i < long_param_count; i++) sum += parse(long_params[i]);
+    uint64_t cycles = host_cycles() - start;
+    sink = sum;
+    if(cycles < best) best = cycles;
+  }
+  return (double)best/long_param_count;
+}
+
+int main(int argc, char **argv) {
+  if(argc > 1) {
+    if(!read_lines(argv[1])) { perror(argv[1]); return 2; }
+  }
+  else generate_lines();
+  find_params();
+
+  int worst_ulps;
+  int float_wrong = compare_floats(worst_ulps);
+  int long_wrong = 0;
+  for(int i = 0; i < long_param_count; i++) {
+    if(parse_long(long_params[i]) != parse_long_strtol(long_params[i])) long_wrong++;
+  }
+
+  double float_cycles = time_floats(parse_float);
+  double strtod_cycles = time_floats(parse_float_strtod);
+  double long_cycles = time_longs(parse_long);
+  double strtol_cycles = time_longs(parse_long_strtol);
+  printf("%s: %d lines, %d parameters, %d line numbers and checksums\n", argc > 1 ? argv[1] : "generated",
+    line_count, float_param_count, long_param_count);
+  printf("parse_float: %.1f cycles per parameter, strtod: %.1f, %.1f times faster, %d values differ by up to %d ulp\n",
+    float_cycles, strtod_cycles, strtod_cycles/float_cycles, float_wrong, worst_ulps);
+  printf("parse_long:  %.1f cycles per number, strtol: %.1f, %.1f times faster, %d values differ\n",
+    long_cycles, strtol_cycles, strtol_cycles/long_cycles, long_wrong);
+  return 0;
+}
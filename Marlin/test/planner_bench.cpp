@@ -0,0 +1,121 @@
+// Host benchmark of plan_buffer_line(): feeds the planner the short segments of a sliced curved model with a full
+// block buffer, as when printing, and reports the worst and average host cycles per call.
+//
+// Every call is timed REPEATS times and the fastest time counts, which leaves out what the host's interrupts and
+// caches add. Host cycles are no AVR cycles, but the planner's share of them changes the same way.
+//
+//   make planner_bench && ./planner_bench
+//   make planner_bench-<git revision> && ./planner_bench-<git revision>   (the planner of an older revision)
+#include "host.h"
+#include "planner.cpp"
+
+#define SEGMENTS 4000
+#define REPEATS 7
+
+// What the planner uses from the rest of the firmware
+volatile int extrudemultiply = 100;
+volatile int feedmultiply = 100;
+void st_wake_up() {}
+void st_set_position(const long &x, const long &y, const long &z, const long &e) {}
+void st_set_e_position(const long &e) {}
+void manage_heater() {}
+void manage_inactivity(byte debug) {}
+void led_status() {}
+float analog2temp(int raw, uint8_t e) { return 210; } // Hot enough to extrude
+void kill() { printf("kill()\n"); exit(1); }
+int target_raw[EXTRUDERS_T];
+int current_raw[EXTRUDERS_T];
+unsigned char FanSpeed;
+uint8_t active_extruder;
+
+// A sliced model: perimeters of an ellipse of 0.3..1 mm chords that grows and shrinks from layer to layer, then
+// a zigzag infill of long lines.
+static float path[SEGMENTS][5]; // x, y, z, e, feed rate in mm/s
+
+static void make_path() {
+  float e = 0;
+  float z = 0.2;
+  float angle = 0;
+  float last_x = 100, last_y = 100;
+  for(int i = 0; i < SEGMENTS; i++) {
+    float x, y, feed_rate;
+    if((i / 400) % 4 != 3) {
+      float radius = 20 + 10*sin(i*0.001);
+      angle += host_random_range(0.3, 1.0) / radius;
+      x = 100 + 1.5*radius*cos(angle);
+      y = 100 + radius*sin(angle);
+      feed_rate = 30;
+    }
+    else {
+      x = (i & 1) ? 130 : 70;
+      y = last_y + 0.4;
+      feed_rate = 60;
+    }
+    e += 0.033*sqrt(square(x - last_x) + square(y - last_y));
+    if(i % 800 == 799) z += 0.2;
+    path[i][0] = x; path[i][1] = y; path[i][2] = z; path[i][3] = e; path[i][4] = feed_rate;
+    last_x = x; last_y = y;
+  }
+}
+
+// Runs the path through the planner and adds the cycles each plan_buffer_line() took to best[]
+static void run_path(uint64_t *best) {
+  plan_init();
+  plan_set_position(100, 100, 0.2, 0);
+  for(int i = 0; i < SEGMENTS; i++) {
+    // The stepper interrupt finishes the oldest block when the buffer is full and starts on the next one
+    if(movesplanned() >= BLOCK_BUFFER_SIZE - 1) {
+      plan_discard_current_block();
+      plan_get_current_block();
+    }
+    uint64_t start = host_cycles();
+    plan_buffer_line(path[i][0], path[i][1], path[i][2], path[i][3], path[i][4], 0);
+    uint64_t cycles = host_cycles() - start;
+    if(cycles < best[i]) best[i] = cycles;
+  }
+}
+
+static int compare_cycles(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main() {
+  static uint64_t best[SEGMENTS];
+  host_serial_quiet = true;
+  axis_steps_per_unit[X_AXIS] = axis_steps_per_unit[Y_AXIS] = 80;
+  axis_steps_per_unit[Z_AXIS] = 4000;
+  axis_steps_per_unit[E_AXIS] = 500;
+  max_feedrate[X_AXIS] = max_feedrate[Y_AXIS] = 300;
+  max_feedrate[Z_AXIS] = 3;
+  max_feedrate[E_AXIS] = 45;
+  for(int8_t i = 0; i < NUM_AXIS; i++) {
+    max_acceleration_units_per_sq_second[i] = (i == Z_AXIS) ? 50 : 1000;
+    axis_steps_per_sqr_second[i] = max_acceleration_units_per_sq_second[i] * axis_steps_per_unit[i];
+  }
+  acceleration = 1000;
+  retract_acceleration = 1000;
+  max_xy_jerk = 15;
+  max_z_jerk = 0.4;
+  max_e_jerk = 5;
+  minimumfeedrate = 0;
+  mintravelfeedrate = 0;
+  minsegmenttime = 20000;
+
+  make_path();
+  for(int i = 0; i < SEGMENTS; i++) best[i] = ~(uint64_t)0;
+  for(int r = 0; r < REPEATS; r++) run_path(best);
+
+  // The first calls fill the empty buffer, the rest are the steady state of a print
+  static uint64_t sorted[SEGMENTS];
+  int count = SEGMENTS - BLOCK_BUFFER_SIZE;
+  uint64_t sum = 0;
+  for(int i = 0; i < count; i++) {
+    sorted[i] = best[BLOCK_BUFFER_SIZE + i];
+    sum += sorted[i];
+  }
+  qsort(sorted, count, sizeof(uint64_t), compare_cycles);
+  printf("plan_buffer_line() with %d blocks, %d segments: %.0f cycles average, %.0f at the 99th percentile, %.0f worst\n",
+    BLOCK_BUFFER_SIZE, count, (double)sum/count, (double)sorted[count*99/100], (double)sorted[count - 1]);
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Simulates the stepper interrupt with S_CURVE_ACCELERATION on single X moves from rest to rest and compares the
+// time of every step with the jerk limited profile the planner set up, worked out in floats:
+//   rate(t) = initial_rate + (cruise_rate - initial_rate)*S(t/acceleration_ticks)  while accelerating,
+//   then cruise_rate, then the mirrored ramp down to final_rate, S as in stepper.cpp.
+// Fails if the rate of the interrupt ever drops while accelerating or rises while decelerating, or if the profile
+// is more than MAX_ERROR steps ahead or behind at any step.
+//
+// The simulated timer runs OCR1A ticks between interrupts, as the speed tables assume, and runs the compare B
+// interrupt that spreads the steps of an interval at OCR1B. The real timer takes OCR1A + 1, so every move is that
+// much slower on the printer, with or without S-curves.
+//
+//   make s_curve_sim && ./s_curve_sim [steps.csv]
+// writes the time of each step in microseconds, the move and the axis position to steps.csv.
+#include "host.h"
+#define S_CURVE_ACCELERATION
+#include "planner.cpp"
+#include "stepper.cpp"
+
+#define TICKS_PER_SECOND (F_CPU/8.0)
+// The interrupt works out the rate at the start of each interval, which may be up to 4 steps long, so it falls a
+// little behind while accelerating and catches up while decelerating
+#define MAX_ERROR 5.0 // Steps
+
+// What the planner and the stepper use from the rest of the firmware
+volatile int extrudemultiply = 100;
+volatile int feedmultiply = 100;
+void manage_heater() {}
+void manage_inactivity(byte debug) {}
+void led_status() {}
+float analog2temp(int raw, uint8_t e) { return 210; }
+void kill() { printf("kill()\n"); exit(1); }
+int target_raw[EXTRUDERS_T];
+int current_raw[EXTRUDERS_T];
+unsigned char FanSpeed;
+uint8_t active_extruder;
+
+// Integral of S from 0 to x
+static double s_curve_integral(double x) {
+  double j = S_CURVE_JERK_PART;
+  double jerk_factor = 1/(2*j*(1 - j));
+  if(x < j) return x*x*x*jerk_factor/3;
+  double end_of_jerk = j*j*j*jerk_factor/3;
+  if(x <= 1 - j) return end_of_jerk + ((x - j/2)*(x - j/2) - j*j/4)/(2*(1 - j));
+  double y = 1 - x;
+  return 0.5 - y + y*y*y*jerk_factor/3;
+}
+
+// The planned profile of a block, position in steps at time t in seconds
+struct profile_t {
+  double initial_rate, cruise_rate, final_rate;
+  double acceleration_time, deceleration_time; // Seconds
+  double ramp_offset;                          // The interrupt starts the clock of the ramp up at its first interval
+  double deceleration_start;                   // Position where the rate goes down
+  double deceleration_start_time;
+};
+
+// Position reached on a ramp from rate to rate + delta_rate that takes duration, after time
+static double ramp_position(double rate, double delta_rate, double duration, double time) {
+  if(duration == 0) return rate*time;
+  if(time > duration) return rate*time + delta_rate*(duration/2 + time - duration);
+  return rate*time + delta_rate*duration*s_curve_integral(time/duration);
+}
+
+// Position of the profile at time t
+static double profile_position(const profile_t &p, double t) {
+  if(t > p.deceleration_start_time) {
+    return p.deceleration_start + ramp_position(p.cruise_rate, p.final_rate - p.cruise_rate, p.deceleration_time,
+      min(t - p.deceleration_start_time, p.deceleration_time));
+  }
+  double delta_rate = p.cruise_rate - p.initial_rate;
+  return ramp_position(p.initial_rate, delta_rate, p.acceleration_time, t + p.ramp_offset) -
+         ramp_position(p.initial_rate, delta_rate, p.acceleration_time, p.ramp_offset);
+}
+
+// Time at which the profile reaches position, found by bisection
+static double profile_time(const profile_t &p, double position) {
+  double low = 0, high = 1;
+  while(profile_position(p, high) < position) high *= 2;
+  for(int i = 0; i < 60; i++) {
+    double middle = (low + high)/2;
+    if(profile_position(p, middle) < position) low = middle;
+    else high = middle;
+  }
+  return (low + high)/2;
+}
+
+// Plans and runs one X move, returns the number of failures
+static int run_move(int move, float distance, float feed_rate, float move_acceleration, FILE *steps_file) {
+  acceleration = travel_acceleration = move_acceleration;
+  plan_init();
+  plan_set_position(0, 0, 0, 0);
+  st_set_position(0, 0, 0, 0);
+  plan_buffer_line(distance, 0, 0, 0, feed_rate, 0);
+  block_t block = block_buffer[block_buffer_tail];
+
+  profile_t p;
+  p.initial_rate = block.initial_rate;
+  p.cruise_rate = block.cruise_rate;
+  p.final_rate = block.final_rate;
+  p.acceleration_time = block.acceleration_ticks/TICKS_PER_SECOND;
+  p.deceleration_time = block.deceleration_ticks/TICKS_PER_SECOND;
+  p.ramp_offset = 0;
+  // The interrupt starts to decelerate after the step event decelerate_after + 1
+  p.deceleration_start = block.decelerate_after + 1;
+  p.deceleration_start_time = INFINITY; // Found on the profile without deceleration
+
+  int failures = 0;
+  double worst_error = 0;
+  unsigned long ticks = 0;
+  long position = 0;
+  unsigned short last_rate = 0;
+  bool decelerating = false;
+  int rate_drops = 0;
+  do {
+    unsigned short at = TCNT1 = 0; // Timer count of the interrupt
+    TIMER1_COMPA_vect();
+    if(ticks == 0) {
+      // The first interrupt started the ramp clock at acceleration_time and added the interval it set up
+      p.ramp_offset = (acceleration_time - OCR1A)/TICKS_PER_SECOND;
+      p.deceleration_start_time = profile_time(p, p.deceleration_start);
+    }
+    // The rate the interrupt works with, checked to only go up, then down
+    if(current_block != NULL) {
+      unsigned short rate = (unsigned long)TICKS_PER_SECOND*step_loops/((unsigned long)OCR1A << oversampling);
+      if(!decelerating && step_events_completed > (unsigned long)decelerate_after) decelerating = true;
+      if(last_rate != 0 && (decelerating ? rate > last_rate : rate < last_rate) && rate != block.nominal_rate) {
+        if(rate_drops++ < 5) printf("move %d: rate %u after %u at step %ld\n", move, rate, last_rate, position);
+      }
+      last_rate = rate;
+    }
+    while(true) {
+      while(position != count_position[X_AXIS]) {
+        double error = fabs(profile_position(p, (ticks + at)/TICKS_PER_SECOND) - position); // In steps
+        if(error > worst_error) worst_error = error;
+        position++;
+        if(steps_file) fprintf(steps_file, "%.1f,%d,%d\n", (ticks + at)*1000000.0/TICKS_PER_SECOND, move, position);
+      }
+      // The compare B interrupt pulses the other steps of the interval
+      if(!(TIMSK1 & (1<<OCIE1B)) || (OCR1B >= OCR1A)) break;
+      at = TCNT1 = OCR1B;
+      TIMER1_COMPB_vect();
+    }
+    ticks += OCR1A;
+  } while(current_block != NULL || blocks_queued());
+
+  if(worst_error > MAX_ERROR) failures++;
+  failures += rate_drops;
+  printf("move %d: %.0f mm at %.0f mm/s and %.0f mm/s^2, %d steps at up to %u steps/s in %.1f ms: "
+    "up to %.2f steps from the profile, the rate turned %d times\n",
+    move, distance, feed_rate, move_acceleration, position, block.cruise_rate, ticks*1000.0/TICKS_PER_SECOND,
+    worst_error, rate_drops);
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  FILE *steps_file = NULL;
+  if(argc > 1) {
+    steps_file = fopen(argv[1], "w");
+    if(steps_file == NULL) { perror(argv[1]); return 2; }
+    fprintf(steps_file, "us,move,x\n");
+  }
+  axis_steps_per_unit[X_AXIS] = axis_steps_per_unit[Y_AXIS] = 80;
+  axis_steps_per_unit[Z_AXIS] = 4000;
+  axis_steps_per_unit[E_AXIS] = 500;
+  max_feedrate[X_AXIS] = max_feedrate[Y_AXIS] = 500;
+  max_feedrate[Z_AXIS] = 3;
+  max_feedrate[E_AXIS] = 45;
+  for(int8_t i = 0; i < NUM_AXIS; i++) {
+    max_acceleration_units_per_sq_second[i] = 20000;
+    axis_steps_per_sqr_second[i] = max_acceleration_units_per_sq_second[i] * axis_steps_per_unit[i];
+  }
+  max_xy_jerk = 15;
+  max_z_jerk = 0.4;
+  max_e_jerk = 5;
+  minsegmenttime = 0;
+
+  int failures = 0;
+  failures += run_move(1, 100, 100, 1000, steps_file);  // Cruises at 8000 steps/s, one step per interrupt
+  failures += run_move(2, 5, 100, 1000, steps_file);    // Too short to reach the feed rate
+  failures += run_move(3, 200, 250, 3000, steps_file);  // 20000 steps/s, two steps per interrupt
+  failures += run_move(4, 150, 400, 5000, steps_file);  // 32000 steps/s, four steps per interrupt
+  failures += run_move(5, 20, 20, 500, steps_file);     // Slow, the bresenham tracer is oversampled
+  if(steps_file) fclose(steps_file);
+  printf(failures ? "FAILED\n" : "passed\n");
+  return failures != 0;
+}
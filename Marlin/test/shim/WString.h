@@ -0,0 +1,17 @@
+// Host stand-in for the Arduino String class, as much of it as MarlinSerial uses
+#ifndef HOST_WSTRING_H
+#define HOST_WSTRING_H
+
+#include <string.h>
+
+class String
+{
+  public:
+    String(const char *str = "") : buffer(str) {}
+    unsigned int length(void) const { return strlen(buffer); }
+    char operator [](unsigned int index) const { return buffer[index]; }
+  private:
+    const char *buffer;
+};
+
+#endif
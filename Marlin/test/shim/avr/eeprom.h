@@ -0,0 +1,10 @@
+// Host stand-in for <avr/eeprom.h>
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+
+inline uint8_t eeprom_read_byte(const uint8_t *) { return 0xff; }
+inline void eeprom_write_byte(uint8_t *, uint8_t) {}
+
+#endif
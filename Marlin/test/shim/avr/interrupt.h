@@ -0,0 +1,13 @@
+// Host stand-in for <avr/interrupt.h>. An interrupt handler becomes a function the harness calls, sei() and cli()
+// only track the interrupt flag in SREG.
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void)
+#define ISR_ALIASOF(vector)
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= ~0x80)
+
+#endif
@@ -0,0 +1,85 @@
+// Host stand-in for <avr/io.h>: the ATmega644P/1284P registers the motion code touches, as plain variables
+// defined in host.h. Pin and bit numbers are those of the real part.
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+#define HOST_REGISTER8(name) extern volatile uint8_t name;
+#define HOST_REGISTER16(name) extern volatile uint16_t name;
+
+HOST_REGISTER8(PINA) HOST_REGISTER8(PORTA) HOST_REGISTER8(DDRA)
+HOST_REGISTER8(PINB) HOST_REGISTER8(PORTB) HOST_REGISTER8(DDRB)
+HOST_REGISTER8(PINC) HOST_REGISTER8(PORTC) HOST_REGISTER8(DDRC)
+HOST_REGISTER8(PIND) HOST_REGISTER8(PORTD) HOST_REGISTER8(DDRD)
+HOST_REGISTER8(SREG)
+HOST_REGISTER8(TCCR0A) HOST_REGISTER8(TCCR0B) HOST_REGISTER8(TIMSK0) HOST_REGISTER8(TIFR0)
+HOST_REGISTER8(OCR0A) HOST_REGISTER8(OCR0B) HOST_REGISTER8(TCNT0)
+HOST_REGISTER8(TCCR1A) HOST_REGISTER8(TCCR1B) HOST_REGISTER8(TIMSK1) HOST_REGISTER8(TIFR1)
+HOST_REGISTER16(OCR1A) HOST_REGISTER16(OCR1B) HOST_REGISTER16(TCNT1)
+HOST_REGISTER8(TCCR2A) HOST_REGISTER8(TCCR2B) HOST_REGISTER8(OCR2A) HOST_REGISTER8(OCR2B)
+HOST_REGISTER8(PCICR) HOST_REGISTER8(PCMSK0) HOST_REGISTER8(PCMSK1) HOST_REGISTER8(PCMSK2) HOST_REGISTER8(PCMSK3)
+HOST_REGISTER8(UBRR0H) HOST_REGISTER8(UBRR0L) HOST_REGISTER8(UCSR0A) HOST_REGISTER8(UCSR0B) HOST_REGISTER8(UDR0)
+HOST_REGISTER8(MCUSR)
+#define UBRR0H UBRR0H // MarlinSerial.h tests for it with #if defined
+#define PCMSK3 PCMSK3 // stepper.cpp tests for it, as on the ATmega644P/1284P
+
+#define PINA0 0
+#define PINA1 1
+#define PINA2 2
+#define PINA3 3
+#define PINA4 4
+#define PINA5 5
+#define PINA6 6
+#define PINA7 7
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PINB6 6
+#define PINB7 7
+#define PINC0 0
+#define PINC1 1
+#define PINC2 2
+#define PINC3 3
+#define PINC4 4
+#define PINC5 5
+#define PINC6 6
+#define PINC7 7
+#define PIND0 0
+#define PIND1 1
+#define PIND2 2
+#define PIND3 3
+#define PIND4 4
+#define PIND5 5
+#define PIND6 6
+#define PIND7 7
+
+#define WGM00 0
+#define WGM01 1
+#define OCIE0A 1
+#define OCIE0B 2
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1A0 6
+#define CS10 0
+#define WGM12 3
+#define WGM13 4
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+#define RXC0 7
+#define UDRE0 5
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIE3 3
+
+#endif
@@ -0,0 +1,19 @@
+// Host stand-in for <avr/pgmspace.h>: program memory is ordinary memory.
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_byte_near(address) pgm_read_byte(address)
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_word_near(address) pgm_read_word(address)
+#define strlen_P strlen
+#define strncmp_P strncmp
+
+typedef char prog_char;
+
+#endif
@@ -0,0 +1,10 @@
+// Host stand-in for <avr/wdt.h>
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define WDTO_4S 8
+#define wdt_enable(timeout)
+#define wdt_disable()
+#define wdt_reset()
+
+#endif
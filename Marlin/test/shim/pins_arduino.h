@@ -0,0 +1,5 @@
+// Host stand-in for the Arduino core's pins_arduino.h, Marlin.ino includes it but uses nothing of it on the host
+#ifndef HOST_PINS_ARDUINO_H
+#define HOST_PINS_ARDUINO_H
+
+#endif
@@ -0,0 +1,14 @@
+// Host stand-in for <util/crc16.h>, the same CRC-XMODEM update as avr-libc
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <stdint.h>
+
+inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+  crc ^= (uint16_t)data << 8;
+  for(uint8_t i = 0; i < 8; i++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+#endif
@@ -0,0 +1,197 @@
+// Simulates the stepper interrupt with timer 1 and records the time of every step pulse, once with
+// SPREAD_MULTI_STEPS and once with the 2 or 4 steps of an interrupt pulsed right after each other, and reports how
+// unevenly the pulses of each axis come:
+//   bunched:  pulses that follow the one before in less than half the interval before that
+//   jump:     the largest change between adjacent intervals, relative to their mean
+//   cruise:   the furthest a pulse is from an even timeline while the block runs at its nominal rate, in intervals
+// Fails if a spread pulse of the fastest axis is bunched, or more than MAX_CRUISE_JITTER off while cruising.
+//
+// The interrupts run late by COMPA_LATENCY and COMPB_LATENCY timer ticks, guesses of what they take on the printer
+// until they pulse the pins.
+//
+//   make step_jitter && ./step_jitter [pulses.csv]
+// writes the time of each pulse in microseconds, the variant, the move and the axis to pulses.csv.
+#include "host.h"
+#include "planner.h"
+#include "stepper.h"
+#include "temperature.h"
+#include "ultralcd.h"
+#include "language.h"
+#include "led.h"
+#include "speed_lookuptable.h"
+#include "planner.cpp"
+
+// The stepper twice, with and without spreading the steps of an interrupt
+namespace spread {
+  #define SPREAD_MULTI_STEPS
+  #include "stepper.cpp"
+}
+namespace burst {
+  #undef SPREAD_MULTI_STEPS
+  #include "stepper.cpp"
+}
+
+#define TICKS_PER_SECOND (F_CPU/8.0)
+#define COMPA_LATENCY 40 // Timer ticks, the interrupt works out the next interval before it pulses
+#define COMPB_LATENCY 6
+#define MAX_CRUISE_JITTER 0.1 // Intervals
+#define MAX_PULSES 40000 // Per axis and move
+
+// What the planner and the stepper use from the rest of the firmware
+volatile int extrudemultiply = 100;
+volatile int feedmultiply = 100;
+void st_wake_up() {}
+void st_set_position(const long &x, const long &y, const long &z, const long &e) {}
+void st_set_e_position(const long &e) {}
+void manage_heater() {}
+void manage_inactivity(byte debug) {}
+void led_status() {}
+float analog2temp(int raw, uint8_t e) { return 210; } // Hot enough to extrude
+void kill() { printf("kill()\n"); exit(1); }
+int target_raw[EXTRUDERS_T];
+int current_raw[EXTRUDERS_T];
+unsigned char FanSpeed;
+uint8_t active_extruder;
+
+// One build of the stepper
+struct stepper_t {
+  const char *name;
+  void (*compa_interrupt)(void);
+  void (*compb_interrupt)(void);
+  volatile long *count_position;
+  block_t **current_block;
+};
+static const stepper_t steppers[] = {
+  { "spread", spread::TIMER1_COMPA_vect, spread::TIMER1_COMPB_vect, spread::count_position, &spread::current_block },
+  { "burst", burst::TIMER1_COMPA_vect, NULL, burst::count_position, &burst::current_block },
+};
+
+static double pulses[NUM_AXIS][MAX_PULSES]; // Time of each pulse in timer ticks
+static int pulse_count[NUM_AXIS];
+
+// Records the pulses the last interrupt output at time
+static void record_pulses(const stepper_t &stepper, double time, FILE *pulses_file, int move) {
+  for(int8_t axis = 0; axis < NUM_AXIS; axis++) {
+    while(pulse_count[axis] < labs(stepper.count_position[axis]) && pulse_count[axis] < MAX_PULSES) {
+      pulses[axis][pulse_count[axis]++] = time;
+      if(pulses_file) {
+        fprintf(pulses_file, "%.1f,%s,%d,%c\n", time*1000000.0/TICKS_PER_SECOND, stepper.name, move, "XYZE"[axis]);
+      }
+    }
+  }
+}
+
+// Plans one move from the origin and runs it through the stepper, returns the number of failures
+static int run_move(const stepper_t &stepper, int move, float x, float y, float feed_rate, float move_acceleration,
+                    FILE *pulses_file) {
+  acceleration = travel_acceleration = move_acceleration;
+  plan_init();
+  plan_set_position(0, 0, 0, 0);
+  for(int8_t axis = 0; axis < NUM_AXIS; axis++) {
+    stepper.count_position[axis] = 0;
+    pulse_count[axis] = 0;
+  }
+  plan_buffer_line(x, y, 0, 0, feed_rate, 0);
+  block_t block = block_buffer[block_buffer_tail];
+
+  double ticks = 0;
+  unsigned long compa_interrupts = 0, compb_interrupts = 0;
+  unsigned short shortest_interval = 65535;
+  TIMSK1 = (1<<OCIE1A);
+  do {
+    TCNT1 = COMPA_LATENCY;
+    stepper.compa_interrupt();
+    compa_interrupts++;
+    record_pulses(stepper, ticks + TCNT1, pulses_file, move);
+    if(*stepper.current_block != NULL && OCR1A < shortest_interval) shortest_interval = OCR1A;
+    // The compare B interrupt pulses the other steps of the interval
+    while((TIMSK1 & (1<<OCIE1B)) && (OCR1B < OCR1A)) {
+      TCNT1 = OCR1B + COMPB_LATENCY;
+      stepper.compb_interrupt();
+      compb_interrupts++;
+      record_pulses(stepper, ticks + TCNT1, pulses_file, move);
+    }
+    ticks += OCR1A;
+  } while(*stepper.current_block != NULL || blocks_queued());
+  TIMSK1 = 0;
+
+  // The axis with the most steps runs at the rate of the block
+  int8_t fastest = X_AXIS;
+  for(int8_t axis = 0; axis < NUM_AXIS; axis++) {
+    if(pulse_count[axis] > pulse_count[fastest]) fastest = axis;
+  }
+  double cruise_start = pulses[fastest][block.accelerate_until + 1];
+  double cruise_end = pulses[fastest][min(block.decelerate_after, (unsigned long)pulse_count[fastest] - 1)];
+
+  int failures = 0;
+  printf("move %d %s: %.0f mm/s, %lu interrupts at up to %.0f/s and %lu to spread steps\n", move, stepper.name,
+    feed_rate, compa_interrupts, TICKS_PER_SECOND/shortest_interval, compb_interrupts);
+  for(int8_t axis = 0; axis < NUM_AXIS; axis++) {
+    int count = pulse_count[axis];
+    if(count < 3) continue;
+    double *t = pulses[axis];
+    int bunched = 0;
+    double worst_jump = 0;
+    for(int i = 2; i < count; i++) {
+      double before = t[i - 1] - t[i - 2], after = t[i] - t[i - 1];
+      if(after < before/2) bunched++;
+      double jump = fabs(after - before)/((after + before)/2);
+      if(jump > worst_jump) worst_jump = jump;
+    }
+    // An even timeline through the first and the last cruising pulse
+    int first = -1, last = -1;
+    for(int i = 0; i < count; i++) {
+      if(t[i] < cruise_start || t[i] > cruise_end) continue;
+      if(first < 0) first = i;
+      last = i;
+    }
+    double cruise_jitter = 0;
+    if(last - first >= 2) {
+      double interval = (t[last] - t[first])/(last - first);
+      for(int i = first; i <= last; i++) {
+        double jitter = fabs(t[i] - (t[first] + (i - first)*interval))/interval;
+        if(jitter > cruise_jitter) cruise_jitter = jitter;
+      }
+    }
+    printf("  %c: %d pulses, %d bunched, intervals jump by up to %.0f%%, up to %.2f intervals off while cruising\n",
+      "XYZE"[axis], count, bunched, worst_jump*100, cruise_jitter);
+    if(stepper.compb_interrupt != NULL && axis == fastest && (bunched > 0 || cruise_jitter > MAX_CRUISE_JITTER)) {
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  FILE *pulses_file = NULL;
+  if(argc > 1) {
+    pulses_file = fopen(argv[1], "w");
+    if(pulses_file == NULL) { perror(argv[1]); return 2; }
+    fprintf(pulses_file, "us,variant,move,axis\n");
+  }
+  axis_steps_per_unit[X_AXIS] = axis_steps_per_unit[Y_AXIS] = 80;
+  axis_steps_per_unit[Z_AXIS] = 4000;
+  axis_steps_per_unit[E_AXIS] = 500;
+  max_feedrate[X_AXIS] = max_feedrate[Y_AXIS] = 500;
+  max_feedrate[Z_AXIS] = 3;
+  max_feedrate[E_AXIS] = 45;
+  for(int8_t i = 0; i < NUM_AXIS; i++) {
+    max_acceleration_units_per_sq_second[i] = 20000;
+    axis_steps_per_sqr_second[i] = max_acceleration_units_per_sq_second[i] * axis_steps_per_unit[i];
+  }
+  max_xy_jerk = 15;
+  max_z_jerk = 0.4;
+  max_e_jerk = 5;
+  minsegmenttime = 0;
+
+  int failures = 0;
+  for(unsigned char s = 0; s < sizeof(steppers)/sizeof(steppers[0]); s++) {
+    const stepper_t &stepper = steppers[s];
+    failures += run_move(stepper, 1, 150, 0, 400, 5000, pulses_file);  // Up to 32000 steps/s, four per interrupt
+    failures += run_move(stepper, 2, 150, 55, 250, 3000, pulses_file); // Two per interrupt, Y follows bresenham
+    failures += run_move(stepper, 3, 20, 7, 20, 500, pulses_file);     // Slow, the bresenham tracer is oversampled
+  }
+  if(pulses_file) fclose(pulses_file);
+  printf(failures ? "FAILED\n" : "passed\n");
+  return failures != 0;
+}
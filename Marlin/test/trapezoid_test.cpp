@@ -0,0 +1,115 @@
+// Compares the trapezoids calculate_trapezoid_for_block() sets up with and without FIXED_POINT_TRAPEZOID against
+// exact ones, over randomized blocks. Fails if a fixed point trapezoid is not exact, and reports how far the float
+// version is off.
+//
+//   make trapezoid_test && ./trapezoid_test
+#include "host.h"
+#include "planner.h"
+#include "stepper.h"
+#include "temperature.h"
+#include "ultralcd.h"
+#include "language.h"
+#include "led.h"
+
+#define BLOCKS 1000000
+
+// The planner twice, once with each version of the trapezoid math
+namespace fixed_point {
+  volatile int extrudemultiply = 100;
+  #define FIXED_POINT_TRAPEZOID
+  #include "planner.cpp"
+}
+namespace floating_point {
+  volatile int extrudemultiply = 100;
+  #undef FIXED_POINT_TRAPEZOID
+  #include "planner.cpp"
+}
+
+// What the planner uses from the rest of the firmware
+volatile int feedmultiply = 100;
+void st_wake_up() {}
+void st_set_position(const long &x, const long &y, const long &z, const long &e) {}
+void st_set_e_position(const long &e) {}
+void manage_heater() {}
+void manage_inactivity(byte debug) {}
+void led_status() {}
+float analog2temp(int raw, uint8_t e) { return 210; }
+void kill() { printf("kill()\n"); exit(1); }
+int target_raw[EXTRUDERS_T];
+int current_raw[EXTRUDERS_T];
+unsigned char FanSpeed;
+uint8_t active_extruder;
+
+// The trapezoid of a block in 64 bit integers, which hold every intermediate result. Rounds as the float version
+// means to: acceleration up, deceleration down and their intersection up.
+static void exact_trapezoid(block_t *block, float entry_factor, float exit_factor, unsigned short nominal_rate,
+                            int64_t &accelerate_until, int64_t &decelerate_after) {
+  int64_t initial_rate = ceil(nominal_rate*entry_factor);
+  int64_t final_rate = ceil(nominal_rate*exit_factor);
+  if(initial_rate < 120) initial_rate = 120;
+  if(final_rate < 120) final_rate = 120;
+  int64_t nominal = nominal_rate;
+  int64_t double_acceleration = 2*(int64_t)block->acceleration_st;
+  int64_t steps = block->step_event_count;
+
+  int64_t accelerate_steps = 0, decelerate_steps = 0;
+  if(nominal > initial_rate)
+    accelerate_steps = (nominal*nominal - initial_rate*initial_rate + double_acceleration - 1) / double_acceleration;
+  if(nominal > final_rate)
+    decelerate_steps = (nominal*nominal - final_rate*final_rate) / double_acceleration;
+  int64_t plateau_steps = steps - accelerate_steps - decelerate_steps;
+  if(plateau_steps < 0) {
+    // ceil((2 a d - s1^2 + s2^2) / (4 a)), the numerator may be negative
+    int64_t numerator = double_acceleration*steps - initial_rate*initial_rate + final_rate*final_rate;
+    int64_t denominator = 2*double_acceleration;
+    accelerate_steps = numerator >= 0 ? (numerator + denominator - 1) / denominator : -(-numerator / denominator);
+    if(accelerate_steps < 0) accelerate_steps = 0;
+    if(accelerate_steps > steps) accelerate_steps = steps;
+    plateau_steps = 0;
+  }
+  accelerate_until = accelerate_steps;
+  decelerate_after = accelerate_steps + plateau_steps;
+}
+
+// Uniform on a logarithmic scale in [low, high)
+static double random_logarithmic(double low, double high) {
+  return exp(host_random_range(log(low), log(high)));
+}
+
+int main() {
+  long fixed_wrong = 0;
+  long float_wrong = 0;
+  int64_t float_worst = 0;
+  for(long i = 0; i < BLOCKS; i++) {
+    block_t block;
+    memset(&block, 0, sizeof(block));
+    block.step_event_count = random_logarithmic(1, 200000);
+    // Below a few steps/s^2 the ramps of the fastest blocks are longer than the long plateau_steps holds
+    block.acceleration_st = random_logarithmic(100, 4000000);
+    unsigned short nominal_rate = random_logarithmic(120, MAX_STEP_FREQUENCY + 1);
+    // Blocks that start or end at rest, at their nominal rate or in between
+    float entry_factor = (host_random() & 3) == 0 ? 0 : (host_random() & 3) == 0 ? 1 : host_random_range(0, 1);
+    float exit_factor = (host_random() & 3) == 0 ? 0 : (host_random() & 3) == 0 ? 1 : host_random_range(0, 1);
+
+    int64_t accelerate_until, decelerate_after;
+    exact_trapezoid(&block, entry_factor, exit_factor, nominal_rate, accelerate_until, decelerate_after);
+
+    fixed_point::calculate_trapezoid_for_block(&block, entry_factor, exit_factor, nominal_rate);
+    if(block.accelerate_until != accelerate_until || block.decelerate_after != decelerate_after) {
+      if(fixed_wrong++ < 10) {
+        printf("fixed point: %lu steps, %lu steps/s^2, nominal %u, entry %f, exit %f: %d..%d instead of %d..%d\n",
+          (unsigned long)block.step_event_count, (unsigned long)block.acceleration_st, nominal_rate, entry_factor,
+          exit_factor, (int)block.accelerate_until, (int)block.decelerate_after, (int)accelerate_until,
+          (int)decelerate_after);
+      }
+    }
+
+    floating_point::calculate_trapezoid_for_block(&block, entry_factor, exit_factor, nominal_rate);
+    int64_t error = max(llabs(block.accelerate_until - accelerate_until), llabs(block.decelerate_after - decelerate_after));
+    if(error != 0) float_wrong++;
+    if(error > float_worst) float_worst = error;
+  }
+  printf("%d random blocks: fixed point %d trapezoids off, float %d off by up to %d steps\n",
+    BLOCKS, fixed_wrong, float_wrong, (int)float_worst);
+  return fixed_wrong != 0;
+}